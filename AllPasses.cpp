@@ -0,0 +1,41 @@
+#include "LLVMPasses.h"
+#include "llvm/Passes/PassBuilder.h"
+#include "llvm/Passes/PassPlugin.h"
+
+using namespace llvm;
+
+llvm::PassPluginLibraryInfo getRIVPluginInfo();
+llvm::PassPluginLibraryInfo getFindFCmpEqPluginInfo();
+llvm::PassPluginLibraryInfo getStaticCallCounterPluginInfo();
+llvm::PassPluginLibraryInfo getOpCodeCounterPluginInfo();
+llvm::PassPluginLibraryInfo getHelloWorldPluginInfo();
+llvm::PassPluginLibraryInfo getInjectFuncCallPluginInfo();
+llvm::PassPluginLibraryInfo getDynamicCounterPluginInfo();
+llvm::PassPluginLibraryInfo getMBAAddPluginInfo();
+llvm::PassPluginLibraryInfo getMBASubPluginInfo();
+llvm::PassPluginLibraryInfo getMBASimplifyPluginInfo();
+llvm::PassPluginLibraryInfo getDuplicateBBPluginInfo();
+llvm::PassPluginLibraryInfo getMergeBBPluginInfo();
+llvm::PassPluginLibraryInfo getConvertFCmpEqPluginInfo();
+
+void registerAllPasses(PassBuilder &PB) {
+  // The plugins that provide analyses come first, so the analyses are
+  // registered before the passes that depend on them: duplicate-bb on RIV and
+  // convert-fcmp-eq on FindFCmpEq.
+  for (auto getPluginInfo :
+       {getRIVPluginInfo, getFindFCmpEqPluginInfo,
+        getStaticCallCounterPluginInfo, getOpCodeCounterPluginInfo,
+        getHelloWorldPluginInfo, getInjectFuncCallPluginInfo,
+        getDynamicCounterPluginInfo, getMBAAddPluginInfo, getMBASubPluginInfo,
+        getMBASimplifyPluginInfo, getDuplicateBBPluginInfo,
+        getMergeBBPluginInfo, getConvertFCmpEqPluginInfo}) {
+    getPluginInfo().RegisterPassBuilderCallbacks(PB);
+  }
+}
+
+// Every pass file also defines a weak llvmGetPassPluginInfo for its own
+// plugin, this definition takes precedence when they are linked together.
+extern "C" ::llvm::PassPluginLibraryInfo llvmGetPassPluginInfo() {
+  return {LLVM_PLUGIN_API_VERSION, "LLVMPassesAll", LLVM_VERSION_STRING,
+          registerAllPasses};
+}
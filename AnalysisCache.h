@@ -0,0 +1,157 @@
+#ifndef ANALYSIS_CACHE_H
+#define ANALYSIS_CACHE_H
+
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/StructuralHash.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Support/xxhash.h"
+#include <cstdlib>
+#include <cstring>
+#include <optional>
+#include <vector>
+
+/**
+ * On-disk cache of function analysis results, so unchanged functions reuse
+ * the results of an earlier run. Computing the key walks the whole function
+ * and a hit reads a file, so it only pays off for analyses that cost more than
+ * a walk over the function, like RIV and its dominator tree.
+ *
+ * The cache is enabled by setting LLVM_PASSES_CACHE_DIR to a directory. A
+ * result is a list of 64-bit words stored in its own file, named after the
+ * analysis and the key of the function. Results that refer to IR store
+ * positions in the function and are remapped to the live IR when loaded.
+ */
+namespace analysis_cache {
+
+constexpr uint64_t Magic = 0x48434143534c4c; // "LLSCACH"
+constexpr uint64_t Version = 1;
+
+/**
+ * Returns the cache directory, or an empty string if the cache is disabled.
+ */
+inline llvm::StringRef getDirectory() {
+  static const std::string directory = [] {
+    const char *dir = getenv("LLVM_PASSES_CACHE_DIR");
+    return std::string(dir ? dir : "");
+  }();
+  return directory;
+}
+
+/**
+ * Returns a key of F that is stable across runs. StructuralHash covers the
+ * opcodes, types and constants of the instructions, the key also covers
+ * which argument, block, instruction or global every operand refers to.
+ */
+inline uint64_t getFunctionKey(const llvm::Function &F) {
+  llvm::DenseMap<const llvm::Value *, uint64_t> local;
+  uint64_t next = 0;
+  for (auto &arg : F.args()) {
+    local[&arg] = next++;
+  }
+  for (auto &BB : F) {
+    local[&BB] = next++;
+    for (auto &I : BB) {
+      local[&I] = next++;
+    }
+  }
+
+  std::vector<uint64_t> words{llvm::StructuralHash(F, /*DetailedHash=*/true),
+                              F.arg_size()};
+  for (auto &BB : F) {
+    for (auto &I : BB) {
+      for (auto &op : I.operands()) {
+        if (auto it = local.find(op.get()); it != local.end()) {
+          words.push_back(it->second);
+        } else if (auto GV = llvm::dyn_cast<llvm::GlobalValue>(op.get())) {
+          words.push_back(llvm::xxh3_64bits(
+              llvm::arrayRefFromStringRef(GV->getName())));
+        } else {
+          words.push_back(~0ULL);
+        }
+      }
+    }
+  }
+  return llvm::xxh3_64bits(llvm::ArrayRef(
+      reinterpret_cast<const uint8_t *>(words.data()),
+      words.size() * sizeof(uint64_t)));
+}
+
+inline std::string getPath(llvm::StringRef analysis, uint64_t key) {
+  llvm::SmallString<128> path(getDirectory());
+  llvm::sys::path::append(path, analysis + "-" +
+                                    llvm::utohexstr(key, false, 16) +
+                                    ".cache");
+  return std::string(path);
+}
+
+/**
+ * Returns the result of the analysis for the function with the given key,
+ * or nothing if it is not cached.
+ */
+inline std::optional<std::vector<uint64_t>> load(llvm::StringRef analysis,
+                                                 uint64_t key) {
+  auto bufferOrErr = llvm::MemoryBuffer::getFile(
+      getPath(analysis, key), /*IsText=*/false,
+      /*RequiresNullTerminator=*/false);
+  if (!bufferOrErr) {
+    return std::nullopt;
+  }
+  llvm::StringRef data = (*bufferOrErr)->getBuffer();
+  uint64_t header[4];
+  if (data.size() < sizeof(header) ||
+      (data.size() - sizeof(header)) % sizeof(uint64_t) != 0) {
+    return std::nullopt;
+  }
+  memcpy(header, data.data(), sizeof(header));
+  size_t numWords = (data.size() - sizeof(header)) / sizeof(uint64_t);
+  if (header[0] != Magic || header[1] != Version || header[2] != key ||
+      header[3] != numWords) {
+    return std::nullopt;
+  }
+  std::vector<uint64_t> words(numWords);
+  memcpy(words.data(), data.data() + sizeof(header),
+         numWords * sizeof(uint64_t));
+  return words;
+}
+
+/**
+ * Stores the result of the analysis for the function with the given key.
+ * The file is written under a temporary name and renamed, so concurrent runs
+ * never read a partial result. Failing to write only loses the cache entry.
+ */
+inline void store(llvm::StringRef analysis, uint64_t key,
+                  llvm::ArrayRef<uint64_t> words) {
+  if (llvm::sys::fs::create_directories(getDirectory())) {
+    return;
+  }
+  std::string path = getPath(analysis, key);
+  int fd;
+  llvm::SmallString<128> tmpPath;
+  if (llvm::sys::fs::createUniqueFile(path + ".tmp%%%%%%", fd, tmpPath)) {
+    return;
+  }
+  {
+    llvm::raw_fd_ostream out(fd, /*shouldClose=*/true);
+    uint64_t header[4] = {Magic, Version, key, words.size()};
+    out.write(reinterpret_cast<const char *>(header), sizeof(header));
+    out.write(reinterpret_cast<const char *>(words.data()),
+              words.size() * sizeof(uint64_t));
+    if (out.has_error()) {
+      out.clear_error();
+      llvm::sys::fs::remove(tmpPath);
+      return;
+    }
+  }
+  if (llvm::sys::fs::rename(tmpPath, path)) {
+    llvm::sys::fs::remove(tmpPath);
+  }
+}
+
+} // namespace analysis_cache
+
+#endif
@@ -1,11 +1,22 @@
 #include "FindFCmpEq.h"
+#include "llvm/IR/IRBuilder.h"
 #include "llvm/IR/Instruction.h"
 #include "llvm/IR/Module.h"
 #include "llvm/Passes/PassBuilder.h"
 #include "llvm/Passes/PassPlugin.h"
+#include "llvm/Support/CommandLine.h"
 
 using namespace llvm;
 
+static cl::opt<double> ConvertFCmpEqFloatEpsilon(
+    "convert-fcmp-eq-float-epsilon",
+    cl::desc("Epsilon of float comparisons (0 uses the machine epsilon)"),
+    cl::init(0));
+static cl::opt<double> ConvertFCmpEqDoubleEpsilon(
+    "convert-fcmp-eq-double-epsilon",
+    cl::desc("Epsilon of double comparisons (0 uses the machine epsilon)"),
+    cl::init(0));
+
 namespace {
 CmpInst::Predicate convertPredicate(FCmpInst *fcmp) noexcept {
   switch (fcmp->getPredicate()) {
@@ -21,26 +32,42 @@ CmpInst::Predicate convertPredicate(FCmpInst *fcmp) noexcept {
     llvm_unreachable("unsupported fcmp predicate");
   }
 }
+/**
+ * Returns the epsilon of comparisons of the scalar floating point type Ty,
+ * which defaults to its machine epsilon 2^(1 - precision).
+ */
+APFloat getEpsilon(Type *Ty) {
+  if (Ty->isFloatTy() && ConvertFCmpEqFloatEpsilon != 0) {
+    return APFloat(static_cast<float>(ConvertFCmpEqFloatEpsilon));
+  }
+  if (Ty->isDoubleTy() && ConvertFCmpEqDoubleEpsilon != 0) {
+    return APFloat(static_cast<double>(ConvertFCmpEqDoubleEpsilon));
+  }
+  auto &semantics = Ty->getFltSemantics();
+  return scalbn(APFloat(semantics, 1),
+                1 - static_cast<int>(APFloat::semanticsPrecision(semantics)),
+                APFloat::rmNearestTiesToEven);
+}
+
+/**
+ * Rewrites a == b as |a - b| < epsilon and a != b as |a - b| >= epsilon. The
+ * absolute value is taken with llvm.fabs, so the comparison stays in the
+ * floating point domain and vector comparisons stay vectors.
+ */
 bool convertFCmpEq(FCmpInst *fcmp) noexcept {
   if (!fcmp->isEquality()) {
     return false;
   }
 
-  LLVMContext &CTX = fcmp->getModule()->getContext();
-  auto I64Ty = IntegerType::get(CTX, 64);
-  auto DoubleTy = Type::getDoubleTy(CTX);
-  auto SignMask = ConstantInt::get(I64Ty, ~(1UL << 63));
-  APInt EpsilonBits(64, 0x3CB0000000000000);
-  auto EpsilonValue = ConstantFP::get(DoubleTy, EpsilonBits.bitsToDouble());
+  Type *Ty = fcmp->getOperand(0)->getType();
+  auto EpsilonValue = ConstantFP::get(Ty, getEpsilon(Ty->getScalarType()));
 
   IRBuilder<> builder(fcmp);
   auto FSub = builder.CreateFSub(fcmp->getOperand(0), fcmp->getOperand(1));
-  auto CastToI64 = builder.CreateBitCast(FSub, I64Ty);
-  auto AbsValue = builder.CreateAnd(CastToI64, SignMask);
-  auto CastToDouble = builder.CreateBitCast(AbsValue, DoubleTy);
+  auto AbsValue = builder.CreateUnaryIntrinsic(Intrinsic::fabs, FSub);
 
   fcmp->setPredicate(convertPredicate(fcmp));
-  fcmp->setOperand(0, CastToDouble);
+  fcmp->setOperand(0, AbsValue);
   fcmp->setOperand(1, EpsilonValue);
   return true;
 }
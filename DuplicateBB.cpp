@@ -1,5 +1,11 @@
+#include "LLVMPasses.h"
 #include "RIV.h"
+#include "llvm/Analysis/BlockFrequencyInfo.h"
+#include "llvm/Analysis/DomTreeUpdater.h"
+#include "llvm/IR/Dominators.h"
 #include "llvm/IR/Module.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/Format.h"
 #include "llvm/Support/RandomNumberGenerator.h"
 #include "llvm/Transforms/Utils/BasicBlockUtils.h"
 #include <map>
@@ -7,27 +13,156 @@
 
 using namespace llvm;
 
+namespace {
+enum class SelectionMode { All, SkipHot, ColdOnly };
+} // namespace
+
+static cl::opt<SelectionMode> DuplicateBBSelection(
+    "duplicate-bb-selection",
+    cl::desc("Which blocks are duplicated, based on their execution frequency "
+             "relative to the function entry"),
+    cl::values(clEnumValN(SelectionMode::All, "all", "Every eligible block"),
+               clEnumValN(SelectionMode::SkipHot, "skip-hot",
+                          "Blocks executed at most once per call, which "
+                          "excludes loop bodies"),
+               clEnumValN(SelectionMode::ColdOnly, "cold-only",
+                          "Blocks executed less than once per call")),
+    cl::init(SelectionMode::All));
+static cl::opt<unsigned> DuplicateBBFunctionBudget(
+    "duplicate-bb-function-budget",
+    cl::desc("Maximum code growth of a function in percent of its size (0 is "
+             "unlimited)"),
+    cl::init(0));
+static cl::opt<unsigned> DuplicateBBModuleBudget(
+    "duplicate-bb-module-budget",
+    cl::desc("Maximum number of instructions added to the module (0 is "
+             "unlimited)"),
+    cl::init(0));
+static cl::opt<bool>
+    DuplicateBBReport("duplicate-bb-report",
+                      cl::desc("Print the code growth and estimated dynamic "
+                               "cost of every function"),
+                      cl::init(false));
+
 namespace {
 struct DuplicateBB : PassInfoMixin<DuplicateBB> {
+  /**
+   * moduleBudget is the maximum number of instructions added to the module,
+   * UINT64_MAX if it is unlimited.
+   */
+  explicit DuplicateBB(uint64_t moduleBudget) : moduleBudget(moduleBudget) {}
+
+  struct Candidate {
+    BasicBlock *BB;
+    Value *checkValue;
+    // Instructions added by duplicating the block.
+    unsigned growth;
+    // Instructions executed per call of the function.
+    double dynamicCost;
+    double frequency;
+  };
+
+  /**
+   * Estimates the cost of duplicating BB. The block gains a null check and
+   * a conditional branch, both copies of it end in a branch to the tail and
+   * every instruction is cloned twice, with the ones producing values
+   * replaced by PHIs and the others deleted in the tail.
+   */
+  static Candidate getCandidate(BasicBlock &BB, Value *checkValue,
+                                double frequency) {
+    unsigned numInstrs = 0, numValues = 0;
+    for (auto &I : make_range(BB.getFirstNonPHI()->getIterator(),
+                              BB.getTerminator()->getIterator())) {
+      ++numInstrs;
+      numValues += !I.getType()->isVoidTy();
+    }
+    return {&BB, checkValue, numInstrs + numValues + 4,
+            frequency * (numValues + 3), frequency};
+  }
+
   PreservedAnalyses run(Function &F, FunctionAnalysisManager &FAM) {
-    if (!pRNG) {
-      pRNG = F.getParent()->createRNG("duplicate-bb");
+    // Seeded per function instead of per module, so the blocks chosen in a
+    // function don't depend on which functions ran before it or on which
+    // thread the function runs.
+    auto pRNG = F.getParent()->createRNG(("duplicate-bb." + F.getName()).str());
+
+    bool useFrequencies = DuplicateBBSelection != SelectionMode::All ||
+                          DuplicateBBFunctionBudget ||
+                          moduleBudget != UINT64_MAX || DuplicateBBReport;
+    auto BFI = useFrequencies ? &FAM.getResult<BlockFrequencyAnalysis>(F)
+                              : nullptr;
+    // Frequencies are relative to the entry block. A zero entry frequency
+    // leaves every block at 1, as without BFI.
+    uint64_t entryFreq = BFI ? BFI->getEntryFreq().getFrequency() : 0;
+
+    // Only one random value is needed per block, so query the RIVs lazily
+    // instead of materializing the set of every block.
+    auto &rivAnalysis = FAM.getResult<LazyRIV>(F);
+    std::vector<Candidate> candidates;
+    unsigned functionSize = 0;
+    for (auto &BB : F) {
+      functionSize += BB.size();
+      unsigned numRIVs = rivAnalysis.count(&BB);
+      if (BB.isLandingPad() || numRIVs == 0) {
+        continue;
+      }
+
+      std::uniform_int_distribution<> Dist(0, numRIVs - 1);
+      Value *checkValue = rivAnalysis.get(&BB, Dist(*pRNG));
+      double frequency = 1.0;
+      if (entryFreq) {
+        frequency = double(BFI->getBlockFreq(&BB).getFrequency()) / entryFreq;
+      }
+      if ((DuplicateBBSelection == SelectionMode::SkipHot && frequency > 1) ||
+          (DuplicateBBSelection == SelectionMode::ColdOnly && frequency >= 1)) {
+        continue;
+      }
+      candidates.push_back(getCandidate(BB, checkValue, frequency));
     }
 
-    RIV::Result rivAnalysis = FAM.getResult<RIV>(F);
+    // With a budget, spend it on the coldest blocks first since they add the
+    // least dynamic cost.
+    uint64_t functionBudget =
+        DuplicateBBFunctionBudget
+            ? uint64_t(functionSize) * DuplicateBBFunctionBudget / 100
+            : UINT64_MAX;
+    uint64_t moduleLeft = moduleBudget != UINT64_MAX
+                              ? moduleBudget - moduleGrowth
+                              : UINT64_MAX;
+    if (functionBudget != UINT64_MAX || moduleLeft != UINT64_MAX) {
+      std::stable_sort(candidates.begin(), candidates.end(),
+                       [](const Candidate &a, const Candidate &b) {
+                         return a.frequency < b.frequency;
+                       });
+    }
     std::map<BasicBlock *, Value *> targets;
-    for (auto &BB : F) {
-      auto &rivs = rivAnalysis[&BB];
-      if (BB.isLandingPad() || rivs.empty()) {
+    uint64_t growth = 0;
+    double dynamicCost = 0;
+    for (auto &candidate : candidates) {
+      if (growth + candidate.growth > std::min(functionBudget, moduleLeft)) {
         continue;
       }
+      targets.emplace(candidate.BB, candidate.checkValue);
+      growth += candidate.growth;
+      dynamicCost += candidate.dynamicCost;
+    }
+    moduleGrowth += growth;
 
-      std::uniform_int_distribution<> Dist(0, rivs.size() - 1);
-      auto it = rivs.begin();
-      std::advance(it, Dist(*pRNG));
-      targets.emplace(&BB, *it);
+    if (DuplicateBBReport) {
+      errs() << F.getName() << ": duplicated " << targets.size() << " of "
+             << candidates.size() << " candidate blocks, size " << functionSize
+             << " -> " << functionSize + growth << " instructions, "
+             << format("%.2f", dynamicCost)
+             << " extra instructions executed per call\n";
     }
 
+    // Splitting a block only adds the if and else blocks below it, so the
+    // dominator tree is updated in place instead of being recomputed by every
+    // later pass. Cloning instructions and replacing them with PHIs leaves
+    // the CFG untouched.
+    auto &DT = FAM.getResult<DominatorTreeAnalysis>(F);
+    DomTreeUpdater DTU(DT, DomTreeUpdater::UpdateStrategy::Lazy);
+
     std::unordered_map<Value *, Value *> valueToPhi;
     for (auto [BB, checkValue] : targets) {
       Instruction *splitAt = BB->getFirstNonPHI();
@@ -36,7 +171,8 @@ struct DuplicateBB : PassInfoMixin<DuplicateBB> {
                                              ? valueToPhi[checkValue]
                                              : checkValue);
       Instruction *thenTerm = nullptr, *elseTerm = nullptr;
-      SplitBlockAndInsertIfThenElse(cond, splitAt, &thenTerm, &elseTerm);
+      SplitBlockAndInsertIfThenElse(cond, splitAt, &thenTerm, &elseTerm,
+                                    /*BranchWeights=*/nullptr, &DTU);
       /*
        * At this point the blocks look like this:
        *
@@ -101,28 +237,43 @@ struct DuplicateBB : PassInfoMixin<DuplicateBB> {
         instr->eraseFromParent();
       }
     }
-    return targets.empty() ? PreservedAnalyses::all()
-                           : PreservedAnalyses::none();
+    DTU.flush();
+    if (targets.empty()) {
+      return PreservedAnalyses::all();
+    }
+    PreservedAnalyses PA;
+    PA.preserve<DominatorTreeAnalysis>();
+    return PA;
   }
   static bool isRequired() { return true; }
 
 private:
-  std::unique_ptr<RandomNumberGenerator> pRNG;
+  uint64_t moduleBudget;
+  // Instructions added to the module so far, checked against moduleBudget.
+  uint64_t moduleGrowth = 0;
 };
 } // namespace
 
+uint64_t getDuplicateBBModuleBudget() {
+  return DuplicateBBModuleBudget ? DuplicateBBModuleBudget : UINT64_MAX;
+}
+
+void registerDuplicateBB(PassBuilder &PB, uint64_t moduleBudget) {
+  PB.registerPipelineParsingCallback(
+      [moduleBudget](StringRef Name, FunctionPassManager &FPM,
+                     ArrayRef<PassBuilder::PipelineElement>) {
+        if (Name == "duplicate-bb") {
+          FPM.addPass(DuplicateBB(moduleBudget));
+          return true;
+        }
+        return false;
+      });
+}
+
 llvm::PassPluginLibraryInfo getDuplicateBBPluginInfo() {
   return {LLVM_PLUGIN_API_VERSION, "DuplicateBB", LLVM_VERSION_STRING,
           [](PassBuilder &PB) {
-            PB.registerPipelineParsingCallback(
-                [](StringRef Name, FunctionPassManager &FPM,
-                   ArrayRef<PassBuilder::PipelineElement>) {
-                  if (Name == "duplicate-bb") {
-                    FPM.addPass(DuplicateBB());
-                    return true;
-                  }
-                  return false;
-                });
+            registerDuplicateBB(PB, getDuplicateBBModuleBudget());
           }};
 }
 
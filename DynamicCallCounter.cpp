@@ -2,13 +2,109 @@
 #include "llvm/IR/Module.h"
 #include "llvm/Passes/PassBuilder.h"
 #include "llvm/Passes/PassPlugin.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Transforms/Utils/BasicBlockUtils.h"
 #include "llvm/Transforms/Utils/ModuleUtils.h"
 
 using namespace llvm;
 
 namespace {
+enum class CounterMode { Global, Atomic, Sharded };
+} // namespace
+
+static cl::opt<CounterMode> DynamicCallCounterMode(
+    "dynamic-call-counter-mode",
+    cl::desc("How the call counters are laid out and updated"),
+    cl::values(clEnumValN(CounterMode::Global, "global",
+                          "One non-atomic i32 global per function"),
+               clEnumValN(CounterMode::Atomic, "atomic",
+                          "One i64 array indexed by function ID, updated "
+                          "with atomic increments"),
+               clEnumValN(CounterMode::Sharded, "sharded",
+                          "Per-thread shards of the i64 array, padded to "
+                          "cache lines and summed when dumped")),
+    cl::init(CounterMode::Global));
+static cl::opt<unsigned> DynamicCallCounterShards(
+    "dynamic-call-counter-shards",
+    cl::desc("Number of counter shards in sharded mode"), cl::init(16));
+static cl::opt<bool> DynamicCallCounterBinary(
+    "dynamic-call-counter-binary",
+    cl::desc("Register the counters with the DynamicCallCounterRT runtime, "
+             "which writes a binary memory mapped profile, instead of "
+             "printing them at exit (implies the atomic mode unless sharded "
+             "is selected)"),
+    cl::init(false));
+static cl::opt<unsigned> DynamicCallCounterSamplePeriod(
+    "dynamic-call-counter-sample-period",
+    cl::desc("Only count 1 in N calls of every function on every thread, the "
+             "dumped counts are scaled back up by N (implies the atomic mode "
+             "unless sharded is selected)"),
+    cl::init(1));
+
+namespace {
+// Number of i64 counters in a 64 byte cache line.
+constexpr unsigned CountersPerCacheLine = 8;
+
+/**
+ * The i64 counter array of the module and its function name table.
+ */
+struct CounterArray {
+  GlobalVariable *counters;
+  GlobalVariable *names;
+  uint64_t numFunctions;
+  uint64_t numShards;
+  uint64_t shardStride;
+  uint64_t samplePeriod;
+};
+
+FunctionCallee getPrintf(Module &M) {
+  LLVMContext &CTX = M.getContext();
+  PointerType *PrintfArgTy =
+      PointerType::getUnqual(IntegerType::getInt8Ty(CTX));
+  FunctionType *PrintfTy =
+      FunctionType::get(IntegerType::getInt32Ty(CTX), PrintfArgTy, true);
+  FunctionCallee Printf = M.getOrInsertFunction("printf", PrintfTy);
+
+  // Set attributes for Printf
+  {
+    auto PrintfF = dyn_cast<Function>(Printf.getCallee());
+    PrintfF->setDoesNotThrow();
+    PrintfF->addParamAttr(0, Attribute::NoCapture);
+    PrintfF->addParamAttr(0, Attribute::ReadOnly);
+  }
+  return Printf;
+}
+
+/**
+ * Creates an internal global initialized with a null terminated string.
+ */
+GlobalVariable *createStringGlobal(Module &M, StringRef str,
+                                   const Twine &name) {
+  auto init = ConstantDataArray::getString(M.getContext(), str);
+  auto global = new GlobalVariable(M, init->getType(), true,
+                                   GlobalValue::PrivateLinkage, init, name);
+  global->setUnnamedAddr(GlobalValue::UnnamedAddr::Global);
+  return global;
+}
+
+/**
+ * Returns the position after the leading allocas of the entry block, so
+ * splitting the entry block there keeps the static allocas in it.
+ */
+BasicBlock::iterator getCounterInsertionPt(Function &F) {
+  auto it = F.getEntryBlock().getFirstInsertionPt();
+  while (isa<AllocaInst>(*it)) {
+    ++it;
+  }
+  return it;
+}
+
 struct DynamicCallCounter : PassInfoMixin<DynamicCallCounter> {
-  PreservedAnalyses run(Module &M, ModuleAnalysisManager &MAM) {
+  /**
+   * Instruments every defined function with a load/add/store on its own
+   * <fn>_Counter global.
+   */
+  bool instrumentGlobalCounters(Module &M) {
     LLVMContext &CTX = M.getContext();
 
     auto counterType = IntegerType::getInt32Ty(CTX);
@@ -35,22 +131,12 @@ struct DynamicCallCounter : PassInfoMixin<DynamicCallCounter> {
       builder.CreateStore(add, functionGlobal);
     }
     if (!changed) {
-      return PreservedAnalyses::all();
+      return false;
     }
 
+    FunctionCallee Printf = getPrintf(M);
     PointerType *PrintfArgTy =
         PointerType::getUnqual(IntegerType::getInt8Ty(CTX));
-    FunctionType *PrintfTy =
-        FunctionType::get(IntegerType::getInt32Ty(CTX), PrintfArgTy, true);
-    FunctionCallee Printf = M.getOrInsertFunction("printf", PrintfTy);
-
-    // Set attributes for Printf
-    {
-      auto PrintfF = dyn_cast<Function>(Printf.getCallee());
-      PrintfF->setDoesNotThrow();
-      PrintfF->addParamAttr(0, Attribute::NoCapture);
-      PrintfF->addParamAttr(0, Attribute::ReadOnly);
-    }
 
     auto formatStr = ConstantDataArray::get(CTX, "%s -> %d\n");
     // Create global initialized with format string constant
@@ -75,7 +161,246 @@ struct DynamicCallCounter : PassInfoMixin<DynamicCallCounter> {
 
     // Calls print function when module is finished
     appendToGlobalDtors(M, printWrapper, 0);
-    return PreservedAnalyses::none();
+    return true;
+  }
+
+  /**
+   * Instruments every defined function with an atomic increment of its slot
+   * in one contiguous i64 counter array. In sharded mode the array holds one
+   * block of counters per shard, each padded to a whole number of cache
+   * lines, and every thread increments the block it claimed on its first
+   * instrumented call so threads don't contend on the same cache line. With
+   * a sample period of N only every N-th call of a thread is counted.
+   */
+  bool instrumentCounterArray(Module &M, CounterMode mode) {
+    LLVMContext &CTX = M.getContext();
+    IRBuilder<> builder(CTX);
+    auto I64Ty = builder.getInt64Ty();
+    auto PtrTy = builder.getPtrTy();
+
+    std::vector<Function *> functions;
+    for (auto &F : M) {
+      if (!F.isDeclaration()) {
+        functions.push_back(&F);
+      }
+    }
+    if (functions.empty()) {
+      return false;
+    }
+
+    uint64_t numFunctions = functions.size();
+    uint64_t numShards = mode == CounterMode::Sharded
+                             ? std::max(1U, DynamicCallCounterShards.getValue())
+                             : 1;
+    uint64_t shardStride = alignTo(numFunctions, CountersPerCacheLine);
+
+    auto countersTy = ArrayType::get(I64Ty, numShards * shardStride);
+    auto counters = new GlobalVariable(M, countersTy, false,
+                                       GlobalValue::InternalLinkage,
+                                       Constant::getNullValue(countersTy),
+                                       "__dcc_counters");
+    counters->setAlignment(Align(CountersPerCacheLine * 8));
+
+    // Returns the base of the calling thread's shard, claiming one round
+    // robin on the first call of every thread.
+    Function *claimShard = nullptr;
+    GlobalVariable *shardBase = nullptr;
+    if (mode == CounterMode::Sharded) {
+      shardBase = new GlobalVariable(
+          M, PtrTy, false, GlobalValue::InternalLinkage,
+          ConstantPointerNull::get(PtrTy), "__dcc_shard_base", nullptr,
+          GlobalValue::InitialExecTLSModel);
+      auto nextShard = new GlobalVariable(
+          M, builder.getInt32Ty(), false, GlobalValue::InternalLinkage,
+          builder.getInt32(0), "__dcc_next_shard");
+
+      claimShard = Function::Create(FunctionType::get(PtrTy, false),
+                                    GlobalValue::InternalLinkage,
+                                    "__dcc_claim_shard", M);
+      claimShard->addFnAttr(Attribute::NoInline);
+      claimShard->addFnAttr(Attribute::Cold);
+      builder.SetInsertPoint(BasicBlock::Create(CTX, "enter", claimShard));
+      auto ticket = builder.CreateAtomicRMW(
+          AtomicRMWInst::Add, nextShard, builder.getInt32(1), MaybeAlign(),
+          AtomicOrdering::Monotonic);
+      auto shard = builder.CreateURem(builder.CreateZExt(ticket, I64Ty),
+                                      builder.getInt64(numShards));
+      auto base = builder.CreateInBoundsGEP(
+          I64Ty, counters,
+          builder.CreateMul(shard, builder.getInt64(shardStride)));
+      builder.CreateStore(base, shardBase);
+      builder.CreateRet(base);
+    }
+
+    // Every thread keeps a countdown per function and only updates the
+    // function's counter when its countdown reaches zero. The array grows with
+    // the module, so it uses the general dynamic TLS model rather than static
+    // TLS, which a dlopen'd module could exhaust.
+    uint64_t samplePeriod =
+        std::max(1U, DynamicCallCounterSamplePeriod.getValue());
+    GlobalVariable *countdowns = nullptr;
+    if (samplePeriod > 1) {
+      auto countdownsTy = ArrayType::get(builder.getInt32Ty(), numFunctions);
+      countdowns = new GlobalVariable(
+          M, countdownsTy, false, GlobalValue::InternalLinkage,
+          Constant::getNullValue(countdownsTy), "__dcc_countdowns", nullptr,
+          GlobalValue::GeneralDynamicTLSModel);
+    }
+
+    for (auto [id, F] : enumerate(functions)) {
+      auto insertPt = getCounterInsertionPt(*F);
+      if (countdowns) {
+        builder.SetInsertPoint(insertPt);
+        auto countdown = builder.CreateConstInBoundsGEP2_64(
+            countdowns->getValueType(), countdowns, 0, id);
+        auto remaining = builder.CreateLoad(builder.getInt32Ty(), countdown,
+                                            "sample.countdown");
+        auto sample = builder.CreateIsNull(remaining);
+        builder.CreateStore(
+            builder.CreateSelect(sample, builder.getInt32(samplePeriod - 1),
+                                 builder.CreateSub(remaining,
+                                                   builder.getInt32(1))),
+            countdown);
+        insertPt = SplitBlockAndInsertIfThen(sample, insertPt, false)
+                       ->getIterator();
+      }
+
+      Value *base = counters;
+      if (mode == CounterMode::Sharded) {
+        builder.SetInsertPoint(insertPt);
+        auto cached = builder.CreateLoad(PtrTy, shardBase, "shard.base");
+        auto unclaimed = builder.CreateIsNull(cached);
+        auto claimTerm = SplitBlockAndInsertIfThen(unclaimed, insertPt, false);
+        builder.SetInsertPoint(claimTerm);
+        auto claimed = builder.CreateCall(claimShard);
+
+        builder.SetInsertPoint(claimTerm->getSuccessor(0)->begin());
+        auto phi = builder.CreatePHI(PtrTy, 2, "shard.base");
+        phi->addIncoming(cached, cached->getParent());
+        phi->addIncoming(claimed, claimTerm->getParent());
+        base = phi;
+      } else {
+        builder.SetInsertPoint(insertPt);
+      }
+
+      auto slot = builder.CreateConstInBoundsGEP1_64(I64Ty, base, id);
+      builder.CreateAtomicRMW(AtomicRMWInst::Add, slot, builder.getInt64(1),
+                              Align(8), AtomicOrdering::Monotonic);
+    }
+
+    // Create a table of the function names indexed by function ID.
+    std::vector<Constant *> names;
+    for (auto F : functions) {
+      names.push_back(createStringGlobal(M, F->getName(), "__dcc_name"));
+    }
+    auto namesTy = ArrayType::get(PtrTy, numFunctions);
+    auto nameTable = new GlobalVariable(M, namesTy, true,
+                                        GlobalValue::InternalLinkage,
+                                        ConstantArray::get(namesTy, names),
+                                        "__dcc_names");
+
+    CounterArray array{counters, nameTable, numFunctions,
+                       numShards, shardStride, samplePeriod};
+    if (DynamicCallCounterBinary) {
+      emitRuntimeRegistration(M, array);
+    } else {
+      emitTextDump(M, array);
+    }
+    return true;
+  }
+
+  /**
+   * Creates a print function that loops over the function IDs and prints the
+   * sum of every shard's counter when the module is finished.
+   */
+  void emitTextDump(Module &M, const CounterArray &array) {
+    LLVMContext &CTX = M.getContext();
+    IRBuilder<> builder(CTX);
+    auto I64Ty = builder.getInt64Ty();
+    auto PtrTy = builder.getPtrTy();
+
+    FunctionCallee Printf = getPrintf(M);
+    auto formatStr = createStringGlobal(M, "%s -> %llu\n", "PrintfFormatStr");
+    auto printWrapperTy = FunctionType::get(Type::getVoidTy(CTX), {}, false);
+    auto printWrapper = dyn_cast<Function>(
+        M.getOrInsertFunction("print_wrapper", printWrapperTy).getCallee());
+    auto enter = BasicBlock::Create(CTX, "enter", printWrapper);
+    auto loop = BasicBlock::Create(CTX, "loop", printWrapper);
+    auto exit = BasicBlock::Create(CTX, "exit", printWrapper);
+    builder.SetInsertPoint(enter);
+    builder.CreateBr(loop);
+
+    builder.SetInsertPoint(loop);
+    auto id = builder.CreatePHI(I64Ty, 2, "id");
+    id->addIncoming(builder.getInt64(0), enter);
+    Value *sum = builder.getInt64(0);
+    for (uint64_t shard = 0; shard < array.numShards; ++shard) {
+      auto slot = builder.CreateInBoundsGEP(
+          I64Ty, array.counters,
+          builder.CreateAdd(id, builder.getInt64(shard * array.shardStride)));
+      auto count = builder.CreateAlignedLoad(I64Ty, slot, Align(8));
+      count->setAtomic(AtomicOrdering::Monotonic);
+      sum = builder.CreateAdd(sum, count);
+    }
+    sum = builder.CreateMul(sum, builder.getInt64(array.samplePeriod));
+    auto name = builder.CreateLoad(
+        PtrTy, builder.CreateInBoundsGEP(PtrTy, array.names, id));
+    builder.CreateCall(Printf, {formatStr, name, sum});
+    auto nextId = builder.CreateAdd(id, builder.getInt64(1));
+    id->addIncoming(nextId, loop);
+    builder.CreateCondBr(
+        builder.CreateICmpULT(nextId, builder.getInt64(array.numFunctions)),
+        loop, exit);
+
+    builder.SetInsertPoint(exit);
+    builder.CreateRetVoid();
+
+    // Calls print function when module is finished
+    appendToGlobalDtors(M, printWrapper, 0);
+  }
+
+  /**
+   * Creates a constructor that hands the counter array and name table to
+   * the runtime, which sums the shards into a memory mapped profile file
+   * periodically and at exit.
+   */
+  void emitRuntimeRegistration(Module &M, const CounterArray &array) {
+    LLVMContext &CTX = M.getContext();
+    IRBuilder<> builder(CTX);
+    auto I32Ty = builder.getInt32Ty();
+    auto PtrTy = builder.getPtrTy();
+
+    // void __dcc_register(const char *const *names, uint64_t *counters,
+    //                     uint32_t numFunctions, uint32_t numShards,
+    //                     uint32_t shardStride, uint32_t samplePeriod)
+    FunctionCallee registerFn = M.getOrInsertFunction(
+        "__dcc_register", builder.getVoidTy(), PtrTy, PtrTy, I32Ty, I32Ty,
+        I32Ty, I32Ty);
+
+    auto initTy = FunctionType::get(builder.getVoidTy(), false);
+    auto init = Function::Create(initTy, GlobalValue::InternalLinkage,
+                                 "__dcc_init", M);
+    builder.SetInsertPoint(BasicBlock::Create(CTX, "enter", init));
+    builder.CreateCall(registerFn,
+                       {array.names, array.counters,
+                        builder.getInt32(array.numFunctions),
+                        builder.getInt32(array.numShards),
+                        builder.getInt32(array.shardStride),
+                        builder.getInt32(array.samplePeriod)});
+    builder.CreateRetVoid();
+    appendToGlobalCtors(M, init, 0);
+  }
+
+  PreservedAnalyses run(Module &M, ModuleAnalysisManager &MAM) {
+    CounterMode mode = DynamicCallCounterMode;
+    if ((DynamicCallCounterBinary || DynamicCallCounterSamplePeriod > 1) &&
+        mode == CounterMode::Global) {
+      mode = CounterMode::Atomic;
+    }
+    bool changed = mode == CounterMode::Global
+                       ? instrumentGlobalCounters(M)
+                       : instrumentCounterArray(M, mode);
+    return changed ? PreservedAnalyses::none() : PreservedAnalyses::all();
   }
   static bool isRequired() { return true; }
 };
@@ -99,4 +424,4 @@ llvm::PassPluginLibraryInfo getDynamicCounterPluginInfo() {
 extern "C" LLVM_ATTRIBUTE_WEAK ::llvm::PassPluginLibraryInfo
 llvmGetPassPluginInfo() {
   return getDynamicCounterPluginInfo();
-}
\ No newline at end of file
+}
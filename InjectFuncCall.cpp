@@ -3,12 +3,24 @@
 #include "llvm/IR/PassManager.h"
 #include "llvm/Passes/PassBuilder.h"
 #include "llvm/Passes/PassPlugin.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Transforms/Utils/ModuleUtils.h"
 
 using namespace llvm;
 
+static cl::opt<bool> InjectFuncCallTrace(
+    "inject-func-call-trace",
+    cl::desc("Record a binary entry event with the InjectFuncCallRT runtime "
+             "instead of calling printf"),
+    cl::init(false));
+
 namespace {
 struct InjectFuncCall : PassInfoMixin<InjectFuncCall> {
-  PreservedAnalyses run(Module &M, ModuleAnalysisManager &) {
+  /**
+   * Calls printf with the function name and number of arguments at the
+   * entry of every defined function.
+   */
+  bool injectPrintf(Module &M) {
     LLVMContext &CTX = M.getContext();
     PointerType *PrintfArgTy =
         PointerType::getUnqual(IntegerType::getInt8Ty(CTX));
@@ -49,6 +61,68 @@ struct InjectFuncCall : PassInfoMixin<InjectFuncCall> {
       builder.CreateCall(Printf, {formatStrVarCast, funcName, args});
       changed = true;
     }
+    return changed;
+  }
+
+  /**
+   * Calls the tracing runtime with the function's ID at the entry of every
+   * defined function. The IDs of the module start at the base returned when
+   * the module's name table is registered from a global constructor.
+   */
+  bool injectTrace(Module &M) {
+    LLVMContext &CTX = M.getContext();
+    IRBuilder<> builder(CTX);
+    auto I32Ty = builder.getInt32Ty();
+    auto PtrTy = builder.getPtrTy();
+
+    std::vector<Function *> functions;
+    for (auto &F : M) {
+      if (!F.isDeclaration()) {
+        functions.push_back(&F);
+      }
+    }
+    if (functions.empty()) {
+      return false;
+    }
+
+    auto idBase = new GlobalVariable(M, I32Ty, false,
+                                     GlobalValue::InternalLinkage,
+                                     builder.getInt32(0), "__ifc_id_base");
+    FunctionCallee traceEnter = M.getOrInsertFunction(
+        "__ifc_trace_enter", builder.getVoidTy(), I32Ty);
+    for (auto [id, F] : enumerate(functions)) {
+      builder.SetInsertPoint(F->getEntryBlock().getFirstInsertionPt());
+      auto base = builder.CreateLoad(I32Ty, idBase);
+      builder.CreateCall(traceEnter,
+                         builder.CreateAdd(base, builder.getInt32(id)));
+    }
+
+    // Create the ctor that registers the function names indexed by ID.
+    auto init = Function::Create(FunctionType::get(builder.getVoidTy(), false),
+                                 GlobalValue::InternalLinkage, "__ifc_init",
+                                 M);
+    builder.SetInsertPoint(BasicBlock::Create(CTX, "enter", init));
+    std::vector<Constant *> names;
+    for (auto F : functions) {
+      names.push_back(builder.CreateGlobalStringPtr(F->getName()));
+    }
+    auto namesTy = ArrayType::get(PtrTy, names.size());
+    auto nameTable = new GlobalVariable(M, namesTy, true,
+                                        GlobalValue::InternalLinkage,
+                                        ConstantArray::get(namesTy, names),
+                                        "__ifc_names");
+    FunctionCallee registerFn = M.getOrInsertFunction(
+        "__ifc_register", I32Ty, PtrTy, I32Ty);
+    auto base = builder.CreateCall(
+        registerFn, {nameTable, builder.getInt32(functions.size())});
+    builder.CreateStore(base, idBase);
+    builder.CreateRetVoid();
+    appendToGlobalCtors(M, init, 0);
+    return true;
+  }
+
+  PreservedAnalyses run(Module &M, ModuleAnalysisManager &) {
+    bool changed = InjectFuncCallTrace ? injectTrace(M) : injectPrintf(M);
     return changed ? PreservedAnalyses::none() : PreservedAnalyses::all();
   }
 };
@@ -0,0 +1,31 @@
+#ifndef LLVM_PASSES_H
+#define LLVM_PASSES_H
+
+#include <cstdint>
+
+namespace llvm {
+class PassBuilder;
+}
+
+/**
+ * Registers every pass and analysis of the repository with PB, as if all of
+ * the pass plugins had been loaded. Tools that link the LLVMPassesAll static
+ * library call this instead of loading any plugin.
+ */
+void registerAllPasses(llvm::PassBuilder &PB);
+
+/**
+ * Returns -duplicate-bb-module-budget, or UINT64_MAX if it is unlimited.
+ */
+uint64_t getDuplicateBBModuleBudget();
+
+/**
+ * Registers the duplicate-bb pass with PB, adding at most moduleBudget
+ * instructions to every module it runs on. Callbacks registered first take
+ * precedence, so calling this before registerAllPasses() overrides
+ * -duplicate-bb-module-budget, e.g. to give every partition of a module its
+ * share of the budget.
+ */
+void registerDuplicateBB(llvm::PassBuilder &PB, uint64_t moduleBudget);
+
+#endif
@@ -0,0 +1,59 @@
+#ifndef MBA_H
+#define MBA_H
+
+#include "llvm/ADT/APInt.h"
+#include "llvm/Analysis/TargetTransformInfo.h"
+#include "llvm/IR/Type.h"
+
+/**
+ * Helpers shared by the mixed boolean-arithmetic passes.
+ */
+namespace mba {
+
+/**
+ * Returns the inverse of the odd value a modulo 2^n, where n is the bit width
+ * of a. Every Newton step doubles the number of correct low bits and an odd
+ * value is its own inverse modulo 8.
+ */
+inline llvm::APInt inverseModPow2(const llvm::APInt &a) {
+  assert(a[0] && "only odd values are invertible modulo 2^n");
+  llvm::APInt inverse = a;
+  llvm::APInt two(a.getBitWidth(), 2);
+  while (a * inverse != 1) {
+    inverse *= two - a * inverse;
+  }
+  return inverse;
+}
+
+/**
+ * Constants of the affine mask ((x * mul1 + add1) * mul2 + add2) == x in
+ * every bit width. For i8 they are the 39, 23, 151 and 111 that mba-add
+ * always used.
+ */
+struct AffineMask {
+  llvm::APInt mul1, add1, mul2, add2;
+
+  explicit AffineMask(unsigned bitWidth)
+      : mul1(llvm::APInt(64, 39).zextOrTrunc(bitWidth)),
+        add1(llvm::APInt(64, 23).zextOrTrunc(bitWidth)),
+        mul2(inverseModPow2(mul1)), add2(-(add1 * mul2)) {}
+};
+
+/**
+ * Returns the reciprocal throughput of the binary operators with the given
+ * opcodes on Ty, which may be a vector type.
+ */
+inline llvm::InstructionCost
+getArithmeticCost(const llvm::TargetTransformInfo &TTI, llvm::Type *Ty,
+                  llvm::ArrayRef<unsigned> opcodes) {
+  llvm::InstructionCost cost = 0;
+  for (auto opcode : opcodes) {
+    cost += TTI.getArithmeticInstrCost(
+        opcode, Ty, llvm::TargetTransformInfo::TCK_RecipThroughput);
+  }
+  return cost;
+}
+
+} // namespace mba
+
+#endif
@@ -1,44 +1,110 @@
+#include "MBA.h"
+#include "llvm/ADT/Statistic.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/IR/IRBuilder.h"
 #include "llvm/Passes/PassBuilder.h"
 #include "llvm/Passes/PassPlugin.h"
+#include "llvm/Support/CommandLine.h"
 
 using namespace llvm;
 
+#define DEBUG_TYPE "mba-add"
+
+STATISTIC(SubstCount, "The # of substituted instructions");
+STATISTIC(CheapSubstCount,
+          "The # of instructions substituted without the affine mask");
+STATISTIC(SkippedCount, "The # of instructions skipped by the cost budget");
+
+static cl::opt<unsigned> MBAAddLoopBudget(
+    "mba-add-loop-budget",
+    cl::desc("Maximum extra cost (reciprocal throughput) of rewriting an add "
+             "inside a loop"),
+    cl::init(4));
+static cl::opt<unsigned> MBAAddFunctionBudget(
+    "mba-add-function-budget",
+    cl::desc("Maximum extra cost (reciprocal throughput) of the rewrites in a "
+             "function (0 is unlimited)"),
+    cl::init(0));
+
 namespace {
 struct MBAAdd : PassInfoMixin<MBAAdd> {
+  /**
+   * Rewrites a + b as (a ^ b) + 2 * (a & b), and, unless cheap is set, masks
+   * the result with an affine function that is the identity. Every operation
+   * is lane-wise, so vector adds stay vectors.
+   */
+  static Value *rewriteAdd(BinaryOperator *binop, bool cheap) {
+    Type *Ty = binop->getType();
+    IRBuilder<> builder(binop);
+    auto Xor = builder.CreateXor(binop->getOperand(0), binop->getOperand(1));
+    auto Bitand = builder.CreateAnd(binop->getOperand(0), binop->getOperand(1));
+    auto Combined = builder.CreateAdd(
+        Xor, builder.CreateMul(ConstantInt::get(Ty, 2), Bitand));
+    if (cheap) {
+      return Combined;
+    }
+
+    mba::AffineMask mask(Ty->getScalarSizeInBits());
+    auto WithNums1 = builder.CreateAdd(
+        builder.CreateMul(Combined, ConstantInt::get(Ty, mask.mul1)),
+        ConstantInt::get(Ty, mask.add1));
+    return builder.CreateAdd(
+        builder.CreateMul(WithNums1, ConstantInt::get(Ty, mask.mul2)),
+        ConstantInt::get(Ty, mask.add2));
+  }
+
   PreservedAnalyses run(Function &F, FunctionAnalysisManager &FAM) {
-    LLVMContext &CTX = F.getContext();
+    auto &TTI = FAM.getResult<TargetIRAnalysis>(F);
+    auto &LI = FAM.getResult<LoopAnalysis>(F);
+
+    InstructionCost functionCost = 0;
     std::vector<BinaryOperator *> freeList;
     for (auto &BB : F) {
+      bool inLoop = LI.getLoopFor(&BB);
       for (auto &I : BB) {
         BinaryOperator *binop;
-        if ((binop = dyn_cast<BinaryOperator>(&I)) &&
-            binop->getOpcode() == Instruction::Add &&
-            binop->getType() == IntegerType::getInt8Ty(CTX)) {
-          IRBuilder<> builder(binop);
-          auto Xor =
-              builder.CreateXor(binop->getOperand(0), binop->getOperand(1));
-          auto Bitand =
-              builder.CreateAnd(binop->getOperand(0), binop->getOperand(1));
-          auto Combined = builder.CreateAdd(
-              Xor,
-              builder.CreateMul(ConstantInt::get(binop->getType(), 2), Bitand));
-          auto WithNums1 = builder.CreateAdd(
-              builder.CreateMul(Combined,
-                                ConstantInt::get(binop->getType(), 39)),
-              ConstantInt::get(binop->getType(), 23));
-          auto WithNums2 = builder.CreateAdd(
-              builder.CreateMul(WithNums1,
-                                ConstantInt::get(binop->getType(), 151)),
-              ConstantInt::get(binop->getType(), 111));
-          binop->replaceAllUsesWith(WithNums2);
-          freeList.push_back(binop);
+        if (!((binop = dyn_cast<BinaryOperator>(&I)) &&
+              binop->getOpcode() == Instruction::Add &&
+              binop->getType()->isIntOrIntVectorTy())) {
+          continue;
+        }
+
+        // The extra cost over the original add of the full rewrite and of the
+        // rewrite without the affine mask. Hot loops get the cheapest rewrite
+        // that fits the budget.
+        Type *Ty = binop->getType();
+        InstructionCost cheapCost = mba::getArithmeticCost(
+            TTI, Ty, {Instruction::Xor, Instruction::And, Instruction::Mul});
+        InstructionCost fullCost =
+            cheapCost + mba::getArithmeticCost(
+                            TTI, Ty,
+                            {Instruction::Mul, Instruction::Add,
+                             Instruction::Mul, Instruction::Add});
+        bool cheap = inLoop && fullCost > MBAAddLoopBudget;
+        InstructionCost cost = cheap ? cheapCost : fullCost;
+        if ((cheap && cheapCost > MBAAddLoopBudget) ||
+            (MBAAddFunctionBudget &&
+             functionCost + cost > MBAAddFunctionBudget)) {
+          SkippedCount++;
+          continue;
+        }
+
+        Value *rewritten = rewriteAdd(binop, cheap);
+        LLVM_DEBUG(dbgs() << *binop << " -> " << *rewritten << "\n");
+        binop->replaceAllUsesWith(rewritten);
+        freeList.push_back(binop);
+        functionCost += cost;
+        SubstCount++;
+        if (cheap) {
+          CheapSubstCount++;
         }
       }
     }
     for (auto binop : freeList) {
       binop->eraseFromParent();
     }
-    return PreservedAnalyses::all();
+    return freeList.empty() ? PreservedAnalyses::all()
+                            : PreservedAnalyses::none();
   }
   static bool isRequired() { return true; }
 };
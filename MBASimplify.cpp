@@ -0,0 +1,136 @@
+#include "llvm/ADT/Statistic.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/PatternMatch.h"
+#include "llvm/Passes/PassBuilder.h"
+#include "llvm/Passes/PassPlugin.h"
+#include "llvm/Transforms/Utils/Local.h"
+
+using namespace llvm;
+using namespace PatternMatch;
+
+#define DEBUG_TYPE "mba-simplify"
+
+STATISTIC(AddCount, "The # of MBA expressions folded back into an add");
+STATISTIC(SubCount, "The # of MBA expressions folded back into a sub");
+STATISTIC(MaskCount, "The # of identity affine masks removed");
+
+namespace {
+struct MBASimplify : PassInfoMixin<MBASimplify> {
+  /**
+   * Returns X if I is ((X * C1 + C2) * C3 + C4) and the constants make it
+   * the identity modulo 2^n, like the mask emitted by mba-add.
+   */
+  static Value *matchAffineMask(Instruction &I) {
+    Value *X;
+    const APInt *C1, *C2, *C3, *C4;
+    if (!match(&I, m_c_Add(m_c_Mul(m_c_Add(m_c_Mul(m_Value(X), m_APInt(C1)),
+                                           m_APInt(C2)),
+                                   m_APInt(C3)),
+                           m_APInt(C4)))) {
+      return nullptr;
+    }
+    if (!(*C1 * *C3).isOne() || !(*C2 * *C3 + *C4).isZero()) {
+      return nullptr;
+    }
+    return X;
+  }
+
+  /**
+   * Returns a + b for (a ^ b) + 2 * (a & b), as emitted by mba-add, and for
+   * (a | b) + (a & b).
+   */
+  static Value *matchAdd(Instruction &I, IRBuilder<> &builder) {
+    Value *A, *B;
+    auto bitAnd = m_c_And(m_Deferred(A), m_Deferred(B));
+    if (match(&I, m_c_Add(m_c_Xor(m_Value(A), m_Value(B)),
+                          m_CombineOr(m_c_Mul(m_SpecificInt(2), bitAnd),
+                                      m_Shl(bitAnd, m_One())))) ||
+        match(&I, m_c_Add(m_c_Or(m_Value(A), m_Value(B)), bitAnd))) {
+      return builder.CreateAdd(A, B);
+    }
+    return nullptr;
+  }
+
+  /**
+   * Returns a - b for (a + ~b) + 1, as emitted by mba-sub. When b is a
+   * constant C, IRBuilder folds ~C and the expression is an ordinary
+   * (a + K) + 1, so it is only folded back when the inner add was itself
+   * recovered from an mba-add expression. Other constant forms are left to
+   * InstCombine.
+   */
+  static Value *matchSub(Instruction &I, IRBuilder<> &builder,
+                         const SmallPtrSetImpl<Value *> &recoveredAdds) {
+    Value *A, *B, *inner;
+    const APInt *NotC;
+    if (match(&I, m_c_Add(m_c_Add(m_Value(A), m_Not(m_Value(B))), m_One()))) {
+      return builder.CreateSub(A, B);
+    }
+    if (match(&I, m_c_Add(m_CombineAnd(m_c_Add(m_Value(A), m_APInt(NotC)),
+                                       m_Value(inner)),
+                          m_One())) &&
+        recoveredAdds.contains(inner)) {
+      return builder.CreateSub(A, ConstantInt::get(A->getType(), ~*NotC));
+    }
+    return nullptr;
+  }
+
+  PreservedAnalyses run(Function &F, FunctionAnalysisManager &FAM) {
+    // Instructions are visited in order, so the add recovered from an MBA
+    // expression is already in place when the mask around it is matched.
+    SmallVector<WeakTrackingVH, 8> freeList;
+    SmallPtrSet<Value *, 8> recoveredAdds;
+    for (auto &BB : F) {
+      for (auto &I : BB) {
+        if (!I.getType()->isIntOrIntVectorTy()) {
+          continue;
+        }
+        IRBuilder<> builder(&I);
+        Value *simplified;
+        if ((simplified = matchAffineMask(I))) {
+          MaskCount++;
+        } else if ((simplified = matchAdd(I, builder))) {
+          recoveredAdds.insert(simplified);
+          AddCount++;
+        } else if ((simplified = matchSub(I, builder, recoveredAdds))) {
+          SubCount++;
+        } else {
+          continue;
+        }
+        LLVM_DEBUG(dbgs() << I << " -> " << *simplified << "\n");
+        I.replaceAllUsesWith(simplified);
+        freeList.push_back(&I);
+      }
+    }
+    if (freeList.empty()) {
+      return PreservedAnalyses::all();
+    }
+
+    // Also deletes the rest of the expressions that are now unused.
+    RecursivelyDeleteTriviallyDeadInstructionsPermissive(freeList);
+    PreservedAnalyses PA;
+    PA.preserveSet<CFGAnalyses>();
+    return PA;
+  }
+  static bool isRequired() { return true; }
+};
+} // namespace
+
+llvm::PassPluginLibraryInfo getMBASimplifyPluginInfo() {
+  return {LLVM_PLUGIN_API_VERSION, "MBASimplify", LLVM_VERSION_STRING,
+          [](PassBuilder &PB) {
+            PB.registerPipelineParsingCallback(
+                [](StringRef Name, FunctionPassManager &FPM,
+                   ArrayRef<PassBuilder::PipelineElement>) {
+                  if (Name == "mba-simplify") {
+                    FPM.addPass(MBASimplify());
+                    return true;
+                  }
+                  return false;
+                });
+          }};
+}
+
+extern "C" LLVM_ATTRIBUTE_WEAK ::llvm::PassPluginLibraryInfo
+llvmGetPassPluginInfo() {
+  return getMBASimplifyPluginInfo();
+}
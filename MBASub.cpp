@@ -1,24 +1,57 @@
+#include "MBA.h"
 #include "llvm/ADT/Statistic.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/IR/IRBuilder.h"
 #include "llvm/Passes/PassBuilder.h"
 #include "llvm/Passes/PassPlugin.h"
+#include "llvm/Support/CommandLine.h"
 
 using namespace llvm;
 
 #define DEBUG_TYPE "mba-sub"
 
 STATISTIC(SubstCount, "The # of substituted instructions");
+STATISTIC(SkippedCount, "The # of instructions skipped by the cost budget");
+
+static cl::opt<unsigned> MBASubLoopBudget(
+    "mba-sub-loop-budget",
+    cl::desc("Maximum extra cost (reciprocal throughput) of rewriting a sub "
+             "inside a loop"),
+    cl::init(4));
+static cl::opt<unsigned> MBASubFunctionBudget(
+    "mba-sub-function-budget",
+    cl::desc("Maximum extra cost (reciprocal throughput) of the rewrites in a "
+             "function (0 is unlimited)"),
+    cl::init(0));
 
 namespace {
 struct MBASub : PassInfoMixin<MBASub> {
   PreservedAnalyses run(Function &F, FunctionAnalysisManager &FAM) {
+    auto &TTI = FAM.getResult<TargetIRAnalysis>(F);
+    auto &LI = FAM.getResult<LoopAnalysis>(F);
+
     bool changed = false;
+    InstructionCost functionCost = 0;
     std::vector<BinaryOperator *> freeList;
     for (auto &BB : F) {
+      bool inLoop = LI.getLoopFor(&BB);
       for (auto &I : BB) {
         BinaryOperator *binop;
         if ((binop = dyn_cast<BinaryOperator>(&I)) &&
             binop->getOpcode() == Instruction::Sub &&
-            binop->getType()->isIntegerTy()) {
+            binop->getType()->isIntOrIntVectorTy()) {
+          // The not and the add of one are the extra cost over the sub.
+          InstructionCost cost = mba::getArithmeticCost(
+              TTI, binop->getType(), {Instruction::Xor, Instruction::Add});
+          if ((inLoop && cost > MBASubLoopBudget) ||
+              (MBASubFunctionBudget &&
+               functionCost + cost > MBASubFunctionBudget)) {
+            SkippedCount++;
+            continue;
+          }
+          functionCost += cost;
+
+          // Every operation is lane-wise, so vector subs stay vectors.
           IRBuilder<> builder(binop);
           auto Not = builder.CreateNot(binop->getOperand(1));
           auto Add = builder.CreateAdd(binop->getOperand(0), Not);
@@ -1,7 +1,10 @@
+#include "llvm/ADT/Hashing.h"
+#include "llvm/ADT/SetVector.h"
 #include "llvm/Passes/PassBuilder.h"
 #include "llvm/Passes/PassPlugin.h"
 #include "llvm/Transforms/Utils/BasicBlockUtils.h"
 #include <ranges>
+#include <unordered_map>
 
 using namespace llvm;
 
@@ -45,6 +48,90 @@ unsigned getNumNonDbgInstrs(BasicBlock *BB) {
       *BB, [](Instruction &I) { return !isa<DbgInfoIntrinsic>(I); });
 }
 
+/**
+ * Returns the position of V among the non-debug instructions of BB, or -1 if
+ * V is not defined in BB.
+ */
+int getLocalPosition(Value *V, BasicBlock *BB) {
+  auto inst = dyn_cast<Instruction>(V);
+  if (!inst || inst->getParent() != BB) {
+    return -1;
+  }
+  return std::ranges::count_if(
+      make_range(BB->begin(), inst->getIterator()),
+      [](Instruction &I) { return !isa<DbgInfoIntrinsic>(I); });
+}
+
+/**
+ * Returns whether BB is not the entry block, has no PHIs, ends in an
+ * unconditional branch and only has predecessors whose branch targets can be
+ * rewritten. The PHIs of a block that is merged away could not be given
+ * values for the predecessors that are redirected to the retained block.
+ */
+bool isMergeCandidate(BasicBlock *BB) {
+  if (BB == &BB->getParent()->getEntryBlock() || isa<PHINode>(BB->begin())) {
+    return false;
+  }
+  auto branchTerm = dyn_cast<BranchInst>(BB->getTerminator());
+  if (!(branchTerm && branchTerm->isUnconditional())) {
+    return false;
+  }
+  for (auto pred : predecessors(BB)) {
+    if (!(isa<BranchInst>(pred->getTerminator()) ||
+          isa<SwitchInst>(pred->getTerminator()))) {
+      return false;
+    }
+  }
+  return true;
+}
+
+/**
+ * Returns whether BB and BB2 pass the same values to every PHI of their
+ * common successor. Values defined in the blocks themselves must be at the
+ * same position, the instruction comparison checks that they are identical.
+ */
+bool identicalIncomingValues(BasicBlock *BB, BasicBlock *BB2) {
+  for (auto &phiNode : BB->getSingleSuccessor()->phis()) {
+    Value *inVal1 = phiNode.getIncomingValueForBlock(BB);
+    Value *inVal2 = phiNode.getIncomingValueForBlock(BB2);
+    if (inVal1 == inVal2) {
+      continue;
+    }
+    int position = getLocalPosition(inVal1, BB);
+    if (position < 0 || position != getLocalPosition(inVal2, BB2)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+/**
+ * Hashes everything a merge candidate must share with a block it can be merged
+ * with: its successor, its instruction count, the opcodes, types and operands
+ * of its instructions and the values it passes to the successor's PHIs.
+ * Incoming values defined in BB itself are hashed by their position.
+ */
+size_t hashBlock(BasicBlock *BB) {
+  BasicBlock *succ = BB->getSingleSuccessor();
+  hash_code hash = hash_combine(succ, getNumNonDbgInstrs(BB));
+  for (auto &phiNode : succ->phis()) {
+    Value *inVal = phiNode.getIncomingValueForBlock(BB);
+    int position = getLocalPosition(inVal, BB);
+    hash = position < 0 ? hash_combine(hash, inVal)
+                        : hash_combine(hash, position);
+  }
+  for (auto &I : *BB) {
+    if (isa<DbgInfoIntrinsic>(I) || I.isTerminator()) {
+      continue;
+    }
+    hash = hash_combine(hash, I.getOpcode(), I.getType());
+    for (auto &op : I.operands()) {
+      hash = hash_combine(hash, op.get());
+    }
+  }
+  return hash;
+}
+
 class LockstepReverseIterator {
   BasicBlock *bb1;
   BasicBlock *bb2;
@@ -86,12 +173,28 @@ public:
 };
 
 struct MergeBB : PassInfoMixin<MergeBB> {
+  std::unordered_map<size_t, SmallVector<BasicBlock *, 4>> buckets;
+  DenseMap<BasicBlock *, size_t> hashes;
+
+  void addToBucket(BasicBlock *BB) {
+    size_t hash = hashBlock(BB);
+    hashes[BB] = hash;
+    buckets[hash].push_back(BB);
+  }
+  void removeFromBucket(BasicBlock *BB) {
+    auto &bucket = buckets[hashes[BB]];
+    bucket.erase(find(bucket, BB));
+  }
+
   /**
    * Rewrite block predecessors to jump to the retained block instead of the
    * erased block.
    */
   void updateBranchTargets(BasicBlock *bbToErase, BasicBlock *bbToRetain) {
-    for (auto pred : predecessors(bbToErase)) {
+    // Redirecting a branch removes it from the erased block's use list, so
+    // collect the predecessors first.
+    SmallVector<BasicBlock *, 8> preds(predecessors(bbToErase));
+    for (auto pred : preds) {
       auto term = pred->getTerminator();
       for (unsigned i = 0; i < term->getNumOperands(); ++i) {
         if (term->getOperand(i) == bbToErase) {
@@ -100,99 +203,75 @@ struct MergeBB : PassInfoMixin<MergeBB> {
       }
     }
   }
-  bool mergeDuplicatedBlock(BasicBlock *BB,
-                            SmallPtrSet<BasicBlock *, 8> &DeleteList) {
-    if (BB == &BB->getParent()->getEntryBlock()) {
-      return false;
-    }
-
-    auto branchTerm = dyn_cast<BranchInst>(BB->getTerminator());
-    if (!(branchTerm && branchTerm->isUnconditional())) {
-      return false;
-    }
-
-    for (auto pred : predecessors(BB)) {
-      if (!(isa<BranchInst>(pred->getTerminator()) ||
-            isa<SwitchInst>(pred->getTerminator()))) {
-        return false;
+  /**
+   * Merges BB into the first block of its hash bucket that is identical to
+   * it. Only blocks in the same bucket can be identical, so the full
+   * comparison is never run against the other predecessors of the successor.
+   */
+  BasicBlock *mergeDuplicatedBlock(BasicBlock *BB) {
+    unsigned numInst = getNumNonDbgInstrs(BB);
+    for (auto BB2 : buckets[hashes[BB]]) {
+      // Blocks with different successors or sizes can share a hash.
+      if (BB == BB2 || BB2->getSingleSuccessor() != BB->getSingleSuccessor() ||
+          numInst != getNumNonDbgInstrs(BB2) ||
+          !identicalIncomingValues(BB, BB2)) {
+        continue;
       }
-    }
 
-    BasicBlock *succ = branchTerm->getSuccessor(0);
-    auto it = succ->begin();
-    auto phiNode = dyn_cast<PHINode>(it);
-    Value *inVal1 = nullptr, *inVal2 = nullptr;
-    Instruction *inInst1 = nullptr, *inInst2 = nullptr;
-    if (phiNode) {
-      // Do not optimize if successor has multiple phi nodes.
-      if (++it != succ->end() && isa<PHINode>(it)) {
-        return false;
+      LockstepReverseIterator it2(BB, BB2);
+      while (it2.isValid() && identicalInstructions((*it2)[0], (*it2)[1])) {
+        --it2;
       }
-      inVal1 = phiNode->getIncomingValueForBlock(BB);
-      inInst1 = dyn_cast<Instruction>(inVal1);
-    }
-
-    unsigned numInst = getNumNonDbgInstrs(BB);
-    for (auto BB2 : predecessors(succ)) {
-      if (BB2 == &BB2->getParent()->getEntryBlock()) {
+      if (it2.isValid()) {
         continue;
       }
-      auto branchTerm2 = dyn_cast<BranchInst>(BB2->getTerminator());
-      if (!(branchTerm2 && branchTerm2->isUnconditional())) {
-        continue;
+      return BB2;
+    }
+    return nullptr;
+  }
+  PreservedAnalyses run(Function &F, FunctionAnalysisManager &FAM) {
+    buckets.clear();
+    hashes.clear();
+    for (auto &BB : F) {
+      if (isMergeCandidate(&BB)) {
+        addToBucket(&BB);
       }
-      for (auto pred : predecessors(BB2)) {
-        if (!(isa<BranchInst>(pred->getTerminator()) ||
-              isa<SwitchInst>(pred->getTerminator()))) {
-          // NOTE: can't do continue in here because its a nested for loop
-          goto continue2;
-        }
+    }
+
+    // Blocks are visited in function order, then every predecessor that was
+    // redirected by a merge is visited again since its successor, and so its
+    // hash, changed. Merging never changes whether another block is a
+    // candidate, so the function is at a fixpoint once the worklist is empty.
+    SetVector<BasicBlock *> worklist;
+    for (auto &BB : reverse(F)) {
+      if (hashes.contains(&BB)) {
+        worklist.insert(&BB);
       }
-      if (DeleteList.contains(BB2) || BB == BB2 ||
-          numInst != getNumNonDbgInstrs(BB2)) {
+    }
+    SmallVector<BasicBlock *, 8> DeleteList;
+    while (!worklist.empty()) {
+      BasicBlock *BB = worklist.pop_back_val();
+      BasicBlock *BB2 = mergeDuplicatedBlock(BB);
+      if (!BB2) {
         continue;
       }
 
-      if (phiNode) {
-        inVal2 = phiNode->getIncomingValueForBlock(BB2);
-        inInst2 = dyn_cast<Instruction>(inVal2);
-        bool bothValuesDefinedInParent =
-            ((inInst1 && inInst1->getParent() == BB) &&
-             (inInst2 && inInst2->getParent() == BB2));
-        if (inVal1 != inVal2 && !bothValuesDefinedInParent) {
-          continue;
-        }
-      }
-
-      {
-        LockstepReverseIterator it2(BB, BB2);
-        while (it2.isValid() && identicalInstructions((*it2)[0], (*it2)[1])) {
-          --it2;
-        }
-        if (it2.isValid()) {
-          continue;
+      SmallVector<BasicBlock *, 8> preds(predecessors(BB));
+      updateBranchTargets(BB, BB2);
+      removeFromBucket(BB);
+      hashes.erase(BB);
+      DeleteList.push_back(BB);
+      for (auto pred : preds) {
+        if (hashes.contains(pred)) {
+          removeFromBucket(pred);
+          addToBucket(pred);
+          worklist.insert(pred);
         }
-
-        updateBranchTargets(BB, BB2);
-        DeleteList.insert(BB);
-        return true;
       }
-
-    continue2:
-      (void)0;
-    }
-    return false;
-  }
-  PreservedAnalyses run(Function &F, FunctionAnalysisManager &FAM) {
-    SmallPtrSet<BasicBlock *, 8> DeleteList;
-    bool changed = false;
-    for (auto &BB : F) {
-      changed |= mergeDuplicatedBlock(&BB, DeleteList);
-    }
-    for (auto BB : DeleteList) {
-      DeleteDeadBlock(BB);
     }
-    return changed ? PreservedAnalyses::none() : PreservedAnalyses::all();
+    DeleteDeadBlocks(DeleteList);
+    return DeleteList.empty() ? PreservedAnalyses::all()
+                              : PreservedAnalyses::none();
   }
   static bool isRequired() { return true; }
 };
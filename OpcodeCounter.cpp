@@ -1,28 +1,52 @@
+#include "llvm/IR/Module.h"
 #include "llvm/IR/PassManager.h"
 #include "llvm/Passes/PassBuilder.h"
 #include "llvm/Passes/PassPlugin.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/JSON.h"
+#include "llvm/Support/Parallel.h"
 #include "llvm/Support/raw_ostream.h"
+#include <array>
 
 using namespace llvm;
 
+static cl::opt<bool>
+    OpcodeCounterJSON("opcode-counter-json",
+                      cl::desc("Print the module opcode report as JSON"),
+                      cl::init(false));
+static cl::opt<bool> OpcodeCounterParallel(
+    "opcode-counter-parallel",
+    cl::desc("Count the opcodes of the module's functions in parallel"),
+    cl::init(false));
+
 namespace {
 
+/**
+ * Number of instructions of each opcode, indexed by Instruction::getOpcode().
+ */
+using OpcodeHistogram = std::array<unsigned, Instruction::OtherOpsEnd>;
+
+OpcodeHistogram countOpcodes(const Function &F) {
+  OpcodeHistogram results{};
+  for (auto &BB : F) {
+    for (auto &I : BB) {
+      results[I.getOpcode()]++;
+    }
+  }
+  return results;
+}
+
+void addHistogram(OpcodeHistogram &to, const OpcodeHistogram &from) {
+  for (unsigned opcode = 0; opcode < from.size(); ++opcode) {
+    to[opcode] += from[opcode];
+  }
+}
+
 struct OpcodeCounter : AnalysisInfoMixin<OpcodeCounter> {
-  using Result = StringMap<int>;
+  using Result = OpcodeHistogram;
 
   OpcodeCounter::Result run(Function &F, FunctionAnalysisManager &) {
-    OpcodeCounter::Result results;
-    for (auto &BB : F) {
-      for (auto &I : BB) {
-        StringRef opcode = I.getOpcodeName();
-        if (results.contains(opcode)) {
-          results[opcode]++;
-        } else {
-          results[opcode] = 1;
-        }
-      }
-    }
-    return results;
+    return countOpcodes(F);
   }
 
   static bool isRequired() { return true; }
@@ -32,13 +56,102 @@ private:
   friend struct AnalysisInfoMixin<OpcodeCounter>;
 };
 
+/**
+ * Combines the opcode histograms of every defined function in the module.
+ */
+struct ModuleOpcodeCounter : AnalysisInfoMixin<ModuleOpcodeCounter> {
+  struct Result {
+    OpcodeHistogram opcodes{};
+    unsigned numFunctions = 0;
+  };
+
+  Result run(Module &M, ModuleAnalysisManager &MAM) {
+    Result result;
+    std::vector<Function *> functions;
+    for (auto &F : M) {
+      if (!F.isDeclaration()) {
+        functions.push_back(&F);
+      }
+    }
+    result.numFunctions = functions.size();
+
+    if (OpcodeCounterParallel) {
+      // The function analysis manager is not thread safe, so count directly
+      // into one histogram per function and combine them in module order.
+      std::vector<OpcodeHistogram> histograms(functions.size());
+      parallelFor(0, functions.size(), [&](size_t i) {
+        histograms[i] = countOpcodes(*functions[i]);
+      });
+      for (auto &histogram : histograms) {
+        addHistogram(result.opcodes, histogram);
+      }
+      return result;
+    }
+
+    auto &FAM =
+        MAM.getResult<FunctionAnalysisManagerModuleProxy>(M).getManager();
+    for (auto F : functions) {
+      addHistogram(result.opcodes, FAM.getResult<OpcodeCounter>(*F));
+    }
+    return result;
+  }
+
+private:
+  static inline AnalysisKey Key = {};
+  friend struct AnalysisInfoMixin<ModuleOpcodeCounter>;
+};
+
 struct OpcodeCounterPrinter : PassInfoMixin<OpcodeCounterPrinter> {
   PreservedAnalyses run(Function &F, FunctionAnalysisManager &FAM) {
-    OpcodeCounter::Result analysis = FAM.getResult<OpcodeCounter>(F);
+    auto &analysis = FAM.getResult<OpcodeCounter>(F);
     errs() << "Analysis: of " << F.getName() << "\n";
-    for (auto key : analysis.keys()) {
-      errs() << key << " -> " << analysis[key] << "\n";
+    for (unsigned opcode = 0; opcode < analysis.size(); ++opcode) {
+      if (analysis[opcode]) {
+        errs() << Instruction::getOpcodeName(opcode) << " -> "
+               << analysis[opcode] << "\n";
+      }
+    }
+    return PreservedAnalyses::all();
+  }
+  static bool isRequired() { return true; }
+};
+
+/**
+ * Prints one report with the combined opcode histogram of the module, built
+ * in a buffer and written out at once.
+ */
+struct OpcodeCounterReport : PassInfoMixin<OpcodeCounterReport> {
+  PreservedAnalyses run(Module &M, ModuleAnalysisManager &MAM) {
+    auto &analysis = MAM.getResult<ModuleOpcodeCounter>(M);
+    std::string buffer;
+    raw_string_ostream out(buffer);
+    if (OpcodeCounterJSON) {
+      json::OStream J(out, 2);
+      J.object([&] {
+        J.attribute("module", M.getModuleIdentifier());
+        J.attribute("functions", analysis.numFunctions);
+        J.attributeObject("opcodes", [&] {
+          for (unsigned opcode = 0; opcode < analysis.opcodes.size();
+               ++opcode) {
+            if (analysis.opcodes[opcode]) {
+              J.attribute(Instruction::getOpcodeName(opcode),
+                          analysis.opcodes[opcode]);
+            }
+          }
+        });
+      });
+      out << "\n";
+    } else {
+      out << "Analysis of " << M.getModuleIdentifier() << " ("
+          << analysis.numFunctions << " functions)\n";
+      for (unsigned opcode = 0; opcode < analysis.opcodes.size(); ++opcode) {
+        if (analysis.opcodes[opcode]) {
+          out << Instruction::getOpcodeName(opcode) << " -> "
+              << analysis.opcodes[opcode] << "\n";
+        }
+      }
     }
+    errs() << out.str();
     return PreservedAnalyses::all();
   }
   static bool isRequired() { return true; }
@@ -58,20 +171,34 @@ llvm::PassPluginLibraryInfo getOpCodeCounterPluginInfo() {
                   }
                   return false;
                 });
+            PB.registerPipelineParsingCallback(
+                [](StringRef Name, ModulePassManager &MPM,
+                   ArrayRef<PassBuilder::PipelineElement>) {
+                  if (Name == "opcode-counter-report") {
+                    MPM.addPass(OpcodeCounterReport());
+                    return true;
+                  }
+                  return false;
+                });
 
-            PB.registerVectorizerStartEPCallback(
-                [](FunctionPassManager &FPM, OptimizationLevel) {
-                  FPM.addPass(OpcodeCounterPrinter());
+            // Report once per module instead of once per function.
+            PB.registerOptimizerLastEPCallback(
+                [](ModulePassManager &MPM, OptimizationLevel) {
+                  MPM.addPass(OpcodeCounterReport());
                 });
 
             PB.registerAnalysisRegistrationCallback(
                 [](FunctionAnalysisManager &FAM) {
                   FAM.registerPass([&] { return OpcodeCounter(); });
                 });
+            PB.registerAnalysisRegistrationCallback(
+                [](ModuleAnalysisManager &MAM) {
+                  MAM.registerPass([&] { return ModuleOpcodeCounter(); });
+                });
           }};
 }
 
 extern "C" LLVM_ATTRIBUTE_WEAK ::llvm::PassPluginLibraryInfo
 llvmGetPassPluginInfo() {
   return getOpCodeCounterPluginInfo();
-}
\ No newline at end of file
+}
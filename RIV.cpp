@@ -1,63 +1,300 @@
 #include "RIV.h"
+#include "AnalysisCache.h"
+#include "llvm/ADT/Statistic.h"
 #include "llvm/IR/Dominators.h"
 #include "llvm/IR/Module.h"
-#include <deque>
 
 using namespace llvm;
 
+#define DEBUG_TYPE "riv"
+
+STATISTIC(CacheHits, "The # of functions whose results were loaded from the "
+                     "analysis cache");
+STATISTIC(CacheMisses, "The # of functions analyzed and added to the "
+                       "analysis cache");
+
+bool RIVResult::ValueSet::contains(const Value *V) const {
+  if (!block_) {
+    return false;
+  }
+  auto it = result_->numbering_.find(V);
+  if (it == result_->numbering_.end()) {
+    return false;
+  }
+  return it->second < result_->numShared_ || block_->defs.test(it->second);
+}
+
+RIVResult::ValueSet::iterator RIVResult::ValueSet::begin() const {
+  if (!block_) {
+    return end();
+  }
+  return iterator(result_, 0, block_->defs.begin());
+}
+
+RIVResult::ValueSet::iterator RIVResult::ValueSet::end() const {
+  const auto &bits = block_ ? block_->defs : emptyBits();
+  return iterator(result_, block_ ? result_->numShared_ : 0, bits.end());
+}
+
+RIVResult::ValueSet RIVResult::operator[](const BasicBlock *BB) const {
+  auto it = blockIndex_.find(BB);
+  if (it == blockIndex_.end()) {
+    return ValueSet(this, nullptr);
+  }
+  return ValueSet(this, &blocks_[it->second]);
+}
+
+std::vector<const BasicBlock *> RIVResult::blocks() const {
+  std::vector<const BasicBlock *> result;
+  result.reserve(blocks_.size());
+  for (auto &entry : blocks_) {
+    result.push_back(entry.block);
+  }
+  return result;
+}
+
 RIV::Result RIV::run(Function &F, FunctionAnalysisManager &FAM) {
-  DominatorTree *domTree = &FAM.getResult<DominatorTreeAnalysis>(F);
   Result result;
 
-  Result definedValues;
+  auto number = [&](Value *V) {
+    result.numbering_[V] = result.values_.size();
+    result.values_.push_back(V);
+  };
+
+  // Globals and arguments are reachable from every block, so they are only
+  // numbered once instead of being copied into every block's set.
+  for (auto &global : F.getParent()->global_values()) {
+    if (global.getType()->isIntegerTy()) {
+      number(&global);
+    }
+  }
+  for (auto &arg : F.args()) {
+    if (arg.getType()->isIntegerTy()) {
+      number(&arg);
+    }
+  }
+  result.numShared_ = result.values_.size();
+
+  // Values defined in a block are numbered contiguously, so a block's
+  // definitions are the range [defsBegin, defsBegin + defsCount).
+  DenseMap<const BasicBlock *, std::pair<unsigned, unsigned>> definedValues;
   for (auto &BB : F) {
-    auto &Values = definedValues[&BB];
+    unsigned begin = result.values_.size();
     for (auto &I : BB) {
       if (I.getType()->isIntegerTy()) {
-        Values.insert(&I);
+        number(&I);
+      }
+    }
+    definedValues[&BB] = {begin, result.values_.size() - begin};
+  }
+
+  // The blocks in dominator tree preorder as pairs of the block's position in
+  // the function and the index of its immediate dominator's entry. Only this
+  // order depends on the dominator tree, so it is all the cache stores.
+  std::vector<uint64_t> order;
+  bool useCache = !analysis_cache::getDirectory().empty();
+  uint64_t key = useCache ? analysis_cache::getFunctionKey(F) : 0;
+  std::vector<BasicBlock *> blocks;
+  for (auto &BB : F) {
+    blocks.push_back(&BB);
+  }
+  if (useCache) {
+    auto cached = analysis_cache::load("riv", key);
+    auto isValid = [&](const std::vector<uint64_t> &words) {
+      if (words.empty() || words.size() % 2 != 0) {
+        return false;
+      }
+      for (size_t i = 0; i < words.size(); i += 2) {
+        if (words[i] >= blocks.size() || (i > 0 && words[i + 1] >= i / 2)) {
+          return false;
+        }
+      }
+      return true;
+    };
+    if (cached && isValid(*cached)) {
+      CacheHits++;
+      order = std::move(*cached);
+    }
+  }
+
+  if (order.empty()) {
+    DominatorTree *domTree = &FAM.getResult<DominatorTreeAnalysis>(F);
+    DenseMap<const BasicBlock *, uint64_t> position;
+    for (auto [i, BB] : enumerate(blocks)) {
+      position[BB] = i;
+    }
+
+    std::vector<std::pair<DomTreeNode *, uint64_t>> worklist;
+    worklist.emplace_back(domTree->getRootNode(), 0);
+    order = {position[domTree->getRootNode()->getBlock()], 0};
+    while (!worklist.empty()) {
+      auto [node, index] = worklist.back();
+      worklist.pop_back();
+      for (auto child : node->children()) {
+        worklist.emplace_back(child, order.size() / 2);
+        order.push_back(position[child->getBlock()]);
+        order.push_back(index);
+      }
+    }
+    if (useCache) {
+      CacheMisses++;
+      analysis_cache::store("riv", key, order);
+    }
+  }
+
+  // Every block reaches the values of its immediate dominator and the values
+  // defined in it.
+  for (size_t i = 0; i < order.size(); i += 2) {
+    BasicBlock *BB = blocks[order[i]];
+    result.blockIndex_[BB] = result.blocks_.size();
+    if (i == 0) {
+      result.blocks_.push_back({BB, {}, 0});
+      continue;
+    }
+    // Index the parent's entry every time, push_back may reallocate.
+    unsigned parentIndex = order[i + 1];
+    auto [defsBegin, defsCount] =
+        definedValues[result.blocks_[parentIndex].block];
+    result.blocks_.push_back({BB, result.blocks_[parentIndex].defs,
+                              result.blocks_[parentIndex].count + defsCount});
+    auto &childDefs = result.blocks_.back().defs;
+    for (unsigned v = defsBegin; v < defsBegin + defsCount; ++v) {
+      childDefs.set(v);
+    }
+  }
+  return result;
+}
+
+bool LazyRIVResult::isReachable(const Value *V, const BasicBlock *BB) const {
+  auto blockIt = blockIndex_.find(BB);
+  if (blockIt == blockIndex_.end() || !V->getType()->isIntegerTy()) {
+    return false;
+  }
+  if (auto arg = dyn_cast<Argument>(V)) {
+    return arg->getParent() == BB->getParent();
+  }
+  if (isa<GlobalValue>(V)) {
+    return true;
+  }
+  auto I = dyn_cast<Instruction>(V);
+  if (!I) {
+    return false;
+  }
+  auto defIt = blockIndex_.find(I->getParent());
+  if (defIt == blockIndex_.end() || defIt->second == blockIt->second) {
+    return false;
+  }
+  const auto &def = infos_[defIt->second], &use = infos_[blockIt->second];
+  return def.dfsIn < use.dfsIn && use.dfsOut < def.dfsOut;
+}
+
+unsigned LazyRIVResult::count(const BasicBlock *BB) const {
+  auto it = blockIndex_.find(BB);
+  if (it == blockIndex_.end()) {
+    return 0;
+  }
+  return numShared_ + infos_[it->second].dominatingDefs;
+}
+
+Value *LazyRIVResult::get(const BasicBlock *BB, unsigned k) const {
+  assert(k < count(BB) && "RIV index out of range");
+  if (k < numShared_) {
+    return values_[k];
+  }
+  k -= numShared_;
+
+  // Find the deepest strict dominator whose definitions start at or before k.
+  // The number of dominating definitions only grows going down the tree, so
+  // climb with the jump pointers while the ancestor still starts after k.
+  unsigned node = jumps_[0][blockIndex_.lookup(BB)];
+  if (infos_[node].dominatingDefs > k) {
+    for (unsigned j = jumps_.size(); j-- > 0;) {
+      unsigned ancestor = jumps_[j][node];
+      if (ancestor != None && infos_[ancestor].dominatingDefs > k) {
+        node = ancestor;
       }
     }
+    node = jumps_[0][node];
   }
+  const auto &info = infos_[node];
+  return values_[info.defsBegin + (k - info.dominatingDefs)];
+}
+
+LazyRIV::Result LazyRIV::run(Function &F, FunctionAnalysisManager &FAM) {
+  DominatorTree *domTree = &FAM.getResult<DominatorTreeAnalysis>(F);
+  Result result;
 
-  auto &entryValues = result[&F.getEntryBlock()];
   for (auto &global : F.getParent()->global_values()) {
     if (global.getType()->isIntegerTy()) {
-      entryValues.insert(&global);
+      result.values_.push_back(&global);
     }
   }
   for (auto &arg : F.args()) {
     if (arg.getType()->isIntegerTy()) {
-      entryValues.insert(&arg);
+      result.values_.push_back(&arg);
     }
   }
+  result.numShared_ = result.values_.size();
 
-  std::deque<DomTreeNode *> worklist;
-  worklist.push_back(domTree->getRootNode());
-
-  while (!worklist.empty()) {
-    auto node = worklist.back();
-    worklist.pop_back();
+  // Walk the dominator tree in preorder, numbering the definitions of each
+  // block and recording the DFS in/out numbers.
+  std::vector<unsigned> parents;
+  std::vector<std::pair<DomTreeNode *, DomTreeNode::const_iterator>> stack;
+  unsigned dfsNum = 0;
+  auto enter = [&](DomTreeNode *node, unsigned parent) {
+    unsigned index = result.infos_.size();
+    result.blockIndex_[node->getBlock()] = index;
+    unsigned dominatingDefs =
+        parent == LazyRIVResult::None
+            ? 0
+            : result.infos_[parent].dominatingDefs +
+                  result.infos_[parent].defsCount;
+    unsigned defsBegin = result.values_.size();
+    for (auto &I : *node->getBlock()) {
+      if (I.getType()->isIntegerTy()) {
+        result.values_.push_back(&I);
+      }
+    }
+    result.infos_.push_back({dfsNum++, 0, defsBegin,
+                             unsigned(result.values_.size() - defsBegin),
+                             dominatingDefs});
+    parents.push_back(parent);
+    stack.emplace_back(node, node->begin());
+  };
 
-    auto &defs = definedValues[node->getBlock()];
-    // Make a copy of the values, not a reference.
-    auto rivs = result[node->getBlock()];
+  enter(domTree->getRootNode(), LazyRIVResult::None);
+  while (!stack.empty()) {
+    auto &[node, childIt] = stack.back();
+    if (childIt == node->end()) {
+      result.infos_[result.blockIndex_[node->getBlock()]].dfsOut = dfsNum++;
+      stack.pop_back();
+      continue;
+    }
+    DomTreeNode *child = *childIt++;
+    enter(child, result.blockIndex_[node->getBlock()]);
+  }
 
-    for (auto child : node->children()) {
-      worklist.push_back(child);
-      result[child->getBlock()].insert(defs.begin(), defs.end());
-      result[child->getBlock()].insert(rivs.begin(), rivs.end());
+  result.jumps_.push_back(std::move(parents));
+  for (unsigned j = 1; (1U << j) < result.infos_.size(); ++j) {
+    const auto &prev = result.jumps_.back();
+    std::vector<unsigned> next(prev.size(), LazyRIVResult::None);
+    for (unsigned i = 0; i < prev.size(); ++i) {
+      if (prev[i] != LazyRIVResult::None) {
+        next[i] = prev[prev[i]];
+      }
     }
+    result.jumps_.push_back(std::move(next));
   }
   return result;
 }
 
 struct RIVPrinter : PassInfoMixin<RIVPrinter> {
   PreservedAnalyses run(Function &F, FunctionAnalysisManager &FAM) {
-    RIV::Result analysis = FAM.getResult<RIV>(F);
-    for (auto [BB, ValSet] : analysis) {
+    auto &analysis = FAM.getResult<RIV>(F);
+    for (auto BB : analysis.blocks()) {
       BB->printAsOperand(errs());
       errs() << " -> {\n";
-      for (auto V : ValSet) {
+      for (auto V : analysis[BB]) {
         V->print(errs());
         errs() << "\n";
       }
@@ -82,6 +319,7 @@ llvm::PassPluginLibraryInfo getRIVPluginInfo() {
             PB.registerAnalysisRegistrationCallback(
                 [](FunctionAnalysisManager &FAM) {
                   FAM.registerPass([&] { return RIV(); });
+                  FAM.registerPass([&] { return LazyRIV(); });
                 });
           }};
 }
@@ -1,12 +1,154 @@
 #ifndef RIV_H
 #define RIV_H
 
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/SparseBitVector.h"
 #include "llvm/Passes/PassBuilder.h"
 #include "llvm/Passes/PassPlugin.h"
+#include <vector>
+
+/**
+ * Reachable integer values of every block in a function.
+ *
+ * Every value is given a dense number. Values that are reachable from every
+ * block (arguments and integer globals) are numbered first and shared by all
+ * blocks, so only the values defined in dominating blocks are stored per block
+ * as a sparse bit vector.
+ */
+class RIVResult {
+  using BitVector = llvm::SparseBitVector<>;
+
+  struct BlockRIVs {
+    const llvm::BasicBlock *block;
+    BitVector defs;
+    unsigned count;
+  };
+
+  std::vector<llvm::Value *> values_;
+  llvm::DenseMap<const llvm::Value *, unsigned> numbering_;
+  unsigned numShared_ = 0;
+  std::vector<BlockRIVs> blocks_;
+  llvm::DenseMap<const llvm::BasicBlock *, unsigned> blockIndex_;
+
+  friend struct RIV;
+
+public:
+  /**
+   * View of the reachable integer values of a single block.
+   */
+  class ValueSet {
+    const RIVResult *result_;
+    const BlockRIVs *block_;
+
+  public:
+    class iterator {
+      const RIVResult *result_;
+      unsigned shared_;
+      BitVector::iterator bit_;
+
+    public:
+      using iterator_category = std::forward_iterator_tag;
+      using value_type = llvm::Value *;
+      using difference_type = std::ptrdiff_t;
+      using pointer = llvm::Value **;
+      using reference = llvm::Value *;
+
+      iterator(const RIVResult *result, unsigned shared,
+               BitVector::iterator bit)
+          : result_(result), shared_(shared), bit_(bit) {}
+      llvm::Value *operator*() const {
+        return result_->values_[shared_ < result_->numShared_ ? shared_
+                                                              : *bit_];
+      }
+      iterator &operator++() {
+        if (shared_ < result_->numShared_) {
+          ++shared_;
+        } else {
+          ++bit_;
+        }
+        return *this;
+      }
+      iterator operator++(int) {
+        iterator old = *this;
+        ++*this;
+        return old;
+      }
+      bool operator==(const iterator &other) const {
+        return shared_ == other.shared_ && bit_ == other.bit_;
+      }
+      bool operator!=(const iterator &other) const { return !(*this == other); }
+    };
+
+    ValueSet(const RIVResult *result, const BlockRIVs *block)
+        : result_(result), block_(block) {}
+    bool empty() const { return size() == 0; }
+    unsigned size() const {
+      return block_ ? result_->numShared_ + block_->count : 0;
+    }
+    bool contains(const llvm::Value *V) const;
+    iterator begin() const;
+    iterator end() const;
+  };
+
+  ValueSet operator[](const llvm::BasicBlock *BB) const;
+  ValueSet lookup(const llvm::BasicBlock *BB) const { return (*this)[BB]; }
+
+  /**
+   * Blocks reachable from the entry block, in dominator tree preorder.
+   */
+  std::vector<const llvm::BasicBlock *> blocks() const;
+
+private:
+  static const BitVector &emptyBits() {
+    static const BitVector empty;
+    return empty;
+  }
+};
+
+/**
+ * Query-only view of the reachable integer values of every block.
+ *
+ * Values are numbered in dominator tree preorder so the values defined in a
+ * block form a contiguous range. A value defined in block D is reachable at
+ * BB iff D strictly dominates BB, which is answered with the DFS in/out
+ * numbers of the dominator tree without materializing any per-block set.
+ */
+class LazyRIVResult {
+  static constexpr unsigned None = ~0U;
+
+  struct BlockInfo {
+    unsigned dfsIn, dfsOut;
+    unsigned defsBegin, defsCount;
+    // Number of values defined in the strict dominators of the block.
+    unsigned dominatingDefs;
+  };
+
+  std::vector<llvm::Value *> values_;
+  unsigned numShared_ = 0;
+  std::vector<BlockInfo> infos_;
+  llvm::DenseMap<const llvm::BasicBlock *, unsigned> blockIndex_;
+  // jumps_[j][i] is the 2^j-th dominator tree ancestor of block i.
+  std::vector<std::vector<unsigned>> jumps_;
+
+  friend struct LazyRIV;
+
+public:
+  /**
+   * Returns true if V is a reachable integer value at BB.
+   */
+  bool isReachable(const llvm::Value *V, const llvm::BasicBlock *BB) const;
+  /**
+   * Returns the number of reachable integer values at BB.
+   */
+  unsigned count(const llvm::BasicBlock *BB) const;
+  /**
+   * Returns the k-th reachable integer value at BB, k < count(BB).
+   */
+  llvm::Value *get(const llvm::BasicBlock *BB, unsigned k) const;
+};
 
 struct RIV : llvm::AnalysisInfoMixin<RIV> {
-  using Result = llvm::MapVector<llvm::BasicBlock const *,
-                                 llvm::SmallPtrSet<llvm::Value *, 8>>;
+  using Result = RIVResult;
 
   Result run(llvm::Function &F, llvm::FunctionAnalysisManager &FAM);
 
@@ -15,4 +157,14 @@ private:
   friend struct AnalysisInfoMixin<RIV>;
 };
 
-#endif
\ No newline at end of file
+struct LazyRIV : llvm::AnalysisInfoMixin<LazyRIV> {
+  using Result = LazyRIVResult;
+
+  Result run(llvm::Function &F, llvm::FunctionAnalysisManager &FAM);
+
+private:
+  static inline llvm::AnalysisKey Key;
+  friend struct AnalysisInfoMixin<LazyRIV>;
+};
+
+#endif
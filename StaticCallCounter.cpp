@@ -1,33 +1,84 @@
 #include "llvm/IR/Module.h"
 #include "llvm/Passes/PassBuilder.h"
 #include "llvm/Passes/PassPlugin.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/ThreadPool.h"
 
 using namespace llvm;
 
+static cl::opt<unsigned> StaticCallCounterThreads(
+    "static-call-counter-threads",
+    cl::desc("Number of threads used to count calls (0 uses every hardware "
+             "thread, 1 counts serially)"),
+    cl::init(1));
+
 namespace {
 struct StaticCallCounter : AnalysisInfoMixin<StaticCallCounter> {
-  using Result = MapVector<const Function *, unsigned>;
+  struct Result {
+    MapVector<const Function *, unsigned> directCalls;
+    // Call sites without a statically known callee, in module order.
+    std::vector<const CallBase *> indirectCalls;
+  };
 
-  Result run(Module &M, ModuleAnalysisManager &) {
-    Result result;
-    for (auto &F : M) {
-      for (auto &BB : F) {
+  /**
+   * Counts the call sites of a contiguous range of functions.
+   */
+  static void countCalls(ArrayRef<const Function *> functions, Result &result) {
+    for (auto F : functions) {
+      for (auto &BB : *F) {
         for (auto &I : BB) {
-          CallBase *CB;
-          Function *DirectInvoc;
           // CallBase is the base subclass of Instruction,
           // CallInst and InvokeInst inherit off of it.
-          if ((CB = dyn_cast<CallBase>(&I)) &&
-              (DirectInvoc = CB->getCalledFunction())) {
-            if (result.contains(DirectInvoc)) {
-              result[DirectInvoc]++;
-            } else {
-              result[DirectInvoc] = 1;
-            }
+          auto CB = dyn_cast<CallBase>(&I);
+          if (!CB) {
+            continue;
+          }
+          if (auto DirectInvoc = CB->getCalledFunction()) {
+            result.directCalls[DirectInvoc]++;
+          } else if (!CB->isInlineAsm()) {
+            result.indirectCalls.push_back(CB);
           }
         }
       }
     }
+  }
+
+  Result run(Module &M, ModuleAnalysisManager &) {
+    Result result;
+    std::vector<const Function *> functions;
+    for (auto &F : M) {
+      functions.push_back(&F);
+    }
+
+    if (StaticCallCounterThreads == 1) {
+      countCalls(functions, result);
+      return result;
+    }
+
+    // Every thread counts a contiguous shard of the functions into its own
+    // result. Merging the shards in order visits the call sites in the same
+    // order as the serial walk, so the merged result is identical to it.
+    DefaultThreadPool pool(hardware_concurrency(StaticCallCounterThreads));
+    unsigned numShards = std::min<size_t>(
+        std::max(pool.getMaxConcurrency(), 1U), functions.size());
+    std::vector<Result> shards(numShards);
+    for (unsigned i = 0; i < numShards; ++i) {
+      size_t begin = functions.size() * i / numShards;
+      size_t end = functions.size() * (i + 1) / numShards;
+      pool.async([&, i, begin, end] {
+        countCalls(ArrayRef(functions).slice(begin, end - begin), shards[i]);
+      });
+    }
+    pool.wait();
+
+    for (auto &shard : shards) {
+      for (auto [F, count] : shard.directCalls) {
+        result.directCalls[F] += count;
+      }
+      result.indirectCalls.insert(result.indirectCalls.end(),
+                                  shard.indirectCalls.begin(),
+                                  shard.indirectCalls.end());
+    }
     return result;
   }
   static bool isRequired() { return true; }
@@ -39,10 +90,18 @@ private:
 
 struct StaticCallCounterPrinter : PassInfoMixin<StaticCallCounterPrinter> {
   PreservedAnalyses run(Module &M, ModuleAnalysisManager &MAM) {
-    StaticCallCounter::Result analysis = MAM.getResult<StaticCallCounter>(M);
-    for (auto [K, V] : analysis) {
+    auto &analysis = MAM.getResult<StaticCallCounter>(M);
+    for (auto [K, V] : analysis.directCalls) {
       errs() << K->getName() << " -> " << V << "\n";
     }
+
+    MapVector<const Function *, unsigned> indirectByCaller;
+    for (auto CB : analysis.indirectCalls) {
+      indirectByCaller[CB->getFunction()]++;
+    }
+    for (auto [caller, V] : indirectByCaller) {
+      errs() << "<indirect in " << caller->getName() << "> -> " << V << "\n";
+    }
     return PreservedAnalyses::all();
   }
   static bool isRequired() { return true; }
@@ -71,4 +130,4 @@ llvm::PassPluginLibraryInfo getStaticCallCounterPluginInfo() {
 extern "C" LLVM_ATTRIBUTE_WEAK ::llvm::PassPluginLibraryInfo
 llvmGetPassPluginInfo() {
   return getStaticCallCounterPluginInfo();
-}
\ No newline at end of file
+}
@@ -15,8 +15,10 @@
 
 #include "llvm/ADT/StringRef.h"
 #include "llvm/ExecutionEngine/JITSymbol.h"
+#include "llvm/ExecutionEngine/Orc/CompileOnDemandLayer.h"
 #include "llvm/ExecutionEngine/Orc/CompileUtils.h"
 #include "llvm/ExecutionEngine/Orc/Core.h"
+#include "llvm/ExecutionEngine/Orc/EPCIndirectionUtils.h"
 #include "llvm/ExecutionEngine/Orc/ExecutionUtils.h"
 #include "llvm/ExecutionEngine/Orc/ExecutorProcessControl.h"
 #include "llvm/ExecutionEngine/Orc/IRCompileLayer.h"
@@ -34,19 +36,30 @@ namespace orc {
 class KaleidoscopeJIT {
 private:
   std::unique_ptr<ExecutionSession> ES;
+  // Set in lazy mode, provides the stubs and the lazy call-through manager.
+  std::unique_ptr<EPCIndirectionUtils> EPCIU;
 
   DataLayout DL;
   MangleAndInterner Mangle;
 
   RTDyldObjectLinkingLayer ObjectLayer;
   IRCompileLayer CompileLayer;
+  // Set in lazy mode. Every function added is replaced by a stub, and only
+  // compiled by CompileLayer the first time it is called.
+  std::unique_ptr<CompileOnDemandLayer> CODLayer;
 
   JITDylib &MainJD;
 
+  static void handleLazyCallThroughError() {
+    errs() << "LazyCallThrough error: Could not find function body";
+    exit(1);
+  }
+
 public:
   KaleidoscopeJIT(std::unique_ptr<ExecutionSession> ExecSession,
+                  std::unique_ptr<EPCIndirectionUtils> EPCIU,
                   JITTargetMachineBuilder JTMB, DataLayout DL)
-      : ES(std::move(ExecSession)), DL(std::move(DL)),
+      : ES(std::move(ExecSession)), EPCIU(std::move(EPCIU)), DL(std::move(DL)),
         Mangle(*this->ES, this->DL),
         ObjectLayer(*this->ES,
                     []() { return std::make_unique<SectionMemoryManager>(); }),
@@ -60,20 +73,45 @@ public:
       ObjectLayer.setOverrideObjectFlagsWithResponsibilityFlags(true);
       ObjectLayer.setAutoClaimResponsibilityForObjectSymbols(true);
     }
+    if (this->EPCIU) {
+      CODLayer = std::make_unique<CompileOnDemandLayer>(
+          *this->ES, CompileLayer, this->EPCIU->getLazyCallThroughManager(),
+          [this] { return this->EPCIU->createIndirectStubsManager(); });
+      // Compile only the function that was called, not the rest of its
+      // module.
+      CODLayer->setPartitionFunction(CompileOnDemandLayer::compileRequested);
+    }
   }
 
   ~KaleidoscopeJIT() {
     if (auto Err = ES->endSession())
       ES->reportError(std::move(Err));
+    if (EPCIU)
+      if (auto Err = EPCIU->cleanup())
+        ES->reportError(std::move(Err));
   }
 
-  static Expected<std::unique_ptr<KaleidoscopeJIT>> Create() {
+  /// Creates the JIT. In lazy mode, functions are compiled the first time
+  /// they are called instead of the first time their module is looked up.
+  static Expected<std::unique_ptr<KaleidoscopeJIT>> Create(bool Lazy = false) {
     auto EPC = SelfExecutorProcessControl::Create();
     if (!EPC)
       return EPC.takeError();
 
     auto ES = std::make_unique<ExecutionSession>(std::move(*EPC));
 
+    std::unique_ptr<EPCIndirectionUtils> EPCIU;
+    if (Lazy) {
+      auto EPCIUOrErr = EPCIndirectionUtils::Create(*ES);
+      if (!EPCIUOrErr)
+        return EPCIUOrErr.takeError();
+      EPCIU = std::move(*EPCIUOrErr);
+      EPCIU->createLazyCallThroughManager(
+          *ES, ExecutorAddr::fromPtr(&handleLazyCallThroughError));
+      if (auto Err = setUpInProcessLCTMReentryViaEPCIU(*EPCIU))
+        return std::move(Err);
+    }
+
     JITTargetMachineBuilder JTMB(
         ES->getExecutorProcessControl().getTargetTriple());
 
@@ -81,8 +119,8 @@ public:
     if (!DL)
       return DL.takeError();
 
-    return std::make_unique<KaleidoscopeJIT>(std::move(ES), std::move(JTMB),
-                                             std::move(*DL));
+    return std::make_unique<KaleidoscopeJIT>(std::move(ES), std::move(EPCIU),
+                                             std::move(JTMB), std::move(*DL));
   }
 
   const DataLayout &getDataLayout() const { return this->DL; }
@@ -92,6 +130,8 @@ public:
   Error addModule(ThreadSafeModule TSM, ResourceTrackerSP RT = nullptr) {
     if (!RT)
       RT = MainJD.getDefaultResourceTracker();
+    if (CODLayer)
+      return CODLayer->add(RT, std::move(TSM));
     return CompileLayer.add(RT, std::move(TSM));
   }
 
@@ -11,49 +11,64 @@
 
 using namespace llvm;
 
-std::unique_ptr<llvm::LLVMContext> TheContext;
-std::unique_ptr<llvm::IRBuilder<>> TheBuilder;
-std::unique_ptr<llvm::Module> TheModule;
-llvm::StringMap<llvm::AllocaInst *> NamedValues;
-llvm::StringMap<std::unique_ptr<PrototypeAST>> FunctionProtos;
-
-std::unique_ptr<llvm::FunctionPassManager> TheFPM;
-std::unique_ptr<llvm::LoopAnalysisManager> TheLAM;
-std::unique_ptr<llvm::FunctionAnalysisManager> TheFAM;
-std::unique_ptr<llvm::CGSCCAnalysisManager> TheCGAM;
-std::unique_ptr<llvm::ModuleAnalysisManager> TheMAM;
-std::unique_ptr<llvm::PassInstrumentationCallbacks> ThePIC;
-std::unique_ptr<llvm::StandardInstrumentations> TheSI;
-
-void initializeModuleAndManagers() {
-  TheContext = std::make_unique<LLVMContext>();
-  TheBuilder = std::make_unique<IRBuilder<>>(*TheContext);
-  TheModule = std::make_unique<Module>("my cool jit", *TheContext);
-
-  TheFPM = std::make_unique<FunctionPassManager>();
-  TheLAM = std::make_unique<LoopAnalysisManager>();
-  TheFAM = std::make_unique<FunctionAnalysisManager>();
-  TheCGAM = std::make_unique<CGSCCAnalysisManager>();
-  TheMAM = std::make_unique<ModuleAnalysisManager>();
-  ThePIC = std::make_unique<PassInstrumentationCallbacks>();
-  TheSI = std::make_unique<StandardInstrumentations>(*TheContext, true);
-  TheSI->registerCallbacks(*ThePIC, TheMAM.get());
-
-  TheFPM->addPass(PromotePass());
-  TheFPM->addPass(InstCombinePass());
-  TheFPM->addPass(ReassociatePass());
-  TheFPM->addPass(GVNPass());
-  TheFPM->addPass(SimplifyCFGPass());
+void PrototypeTable::add(std::shared_ptr<const PrototypeAST> proto) {
+  std::unique_lock<std::shared_mutex> lock(mutex_);
+  auto &entries = protos_[proto->getSymbol()];
+  if (any_of(entries, [&](const Entry &e) { return e.proto == proto; })) {
+    return;
+  }
+  entries.push_back({++version_, std::move(proto)});
+}
+
+uint64_t PrototypeTable::getVersion() const {
+  std::shared_lock<std::shared_mutex> lock(mutex_);
+  return version_;
+}
+
+std::shared_ptr<const PrototypeAST>
+PrototypeTable::lookup(Symbol name, uint64_t version) const {
+  std::shared_lock<std::shared_mutex> lock(mutex_);
+  auto it = protos_.find(name);
+  if (it == protos_.end()) {
+    return nullptr;
+  }
+  for (auto &entry : reverse(it->second)) {
+    if (entry.version <= version) {
+      return entry.proto;
+    }
+  }
+  return nullptr;
+}
+
+void CodegenContext::reset() {
+  llvmContext = std::make_unique<LLVMContext>();
+  builder = std::make_unique<IRBuilder<>>(*llvmContext);
+  irModule = std::make_unique<Module>("my cool jit", *llvmContext);
+
+  fpm = std::make_unique<FunctionPassManager>();
+  lam = std::make_unique<LoopAnalysisManager>();
+  fam = std::make_unique<FunctionAnalysisManager>();
+  cgam = std::make_unique<CGSCCAnalysisManager>();
+  mam = std::make_unique<ModuleAnalysisManager>();
+  pic = std::make_unique<PassInstrumentationCallbacks>();
+  si = std::make_unique<StandardInstrumentations>(*llvmContext, true);
+  si->registerCallbacks(*pic, mam.get());
+
+  fpm->addPass(PromotePass());
+  fpm->addPass(InstCombinePass());
+  fpm->addPass(ReassociatePass());
+  fpm->addPass(GVNPass());
+  fpm->addPass(SimplifyCFGPass());
 
   PassBuilder PB;
-  PB.registerModuleAnalyses(*TheMAM);
-  PB.registerFunctionAnalyses(*TheFAM);
-  PB.crossRegisterProxies(*TheLAM, *TheFAM, *TheCGAM, *TheMAM);
+  PB.registerModuleAnalyses(*mam);
+  PB.registerFunctionAnalyses(*fam);
+  PB.crossRegisterProxies(*lam, *fam, *cgam, *mam);
 }
 
-void initializeModuleAndManagers(const DataLayout &layout) {
-  initializeModuleAndManagers();
-  TheModule->setDataLayout(layout);
+void CodegenContext::reset(const DataLayout &layout) {
+  reset();
+  irModule->setDataLayout(layout);
 }
 
 static AllocaInst *createEntryBlockAlloca(Function *fn, StringRef varName) {
@@ -62,184 +77,211 @@ static AllocaInst *createEntryBlockAlloca(Function *fn, StringRef varName) {
                               varName);
 }
 
-Function *getFunction(StringRef name) {
-  if (auto fn = TheModule->getFunction(name)) {
+Function *CodegenContext::getFunction(Symbol name) {
+  if (auto fn = irModule->getFunction(name.getName())) {
     return fn;
   }
-  if (FunctionProtos.contains(name)) {
-    return FunctionProtos[name]->codegen();
+  if (auto proto = protos.lookup(name, protosVersion)) {
+    return proto->codegen(*this);
   }
   return nullptr;
 }
 
-Value *NumberExprAST::codegen() {
-  return ConstantFP::get(*TheContext, APFloat(val_));
+Value *ExprAST::codegen(CodegenContext &ctx) {
+  switch (kind_) {
+  case Kind::Number:
+    return static_cast<NumberExprAST *>(this)->codegen(ctx);
+  case Kind::Variable:
+    return static_cast<VariableExprAST *>(this)->codegen(ctx);
+  case Kind::Var:
+    return static_cast<VarExprAST *>(this)->codegen(ctx);
+  case Kind::Binary:
+    return static_cast<BinaryExprAST *>(this)->codegen(ctx);
+  case Kind::Unary:
+    return static_cast<UnaryExprAST *>(this)->codegen(ctx);
+  case Kind::If:
+    return static_cast<IfExprAST *>(this)->codegen(ctx);
+  case Kind::For:
+    return static_cast<ForExprAST *>(this)->codegen(ctx);
+  case Kind::Call:
+    return static_cast<CallExprAST *>(this)->codegen(ctx);
+  }
+  llvm_unreachable("unknown expression kind");
+}
+
+Value *NumberExprAST::codegen(CodegenContext &ctx) {
+  return ConstantFP::get(*ctx.llvmContext, APFloat(val_));
 }
 
-Value *VariableExprAST::codegen() {
-  if (!NamedValues.contains(name_)) {
-    throw CodegenException("Variable " + name_ +
+Value *VariableExprAST::codegen(CodegenContext &ctx) {
+  auto alloca = ctx.namedValues.lookup(name_);
+  if (!alloca) {
+    throw CodegenException("Variable " + name_.getName().str() +
                            " can't be found in environment");
   }
-  auto alloca = NamedValues.lookup(name_);
-  return TheBuilder->CreateLoad(alloca->getAllocatedType(), alloca, name_);
+  return ctx.builder->CreateLoad(alloca->getAllocatedType(), alloca,
+                                 name_.getName());
 }
 
-Value *VarExprAST::codegen() {
-  StringMap<llvm::AllocaInst *> oldValues;
-  auto fn = TheBuilder->GetInsertBlock()->getParent();
-  for (auto &[var, init] : varNames_) {
-    auto initVal =
-        init ? init->codegen() : ConstantFP::get(*TheContext, APFloat(0.0));
-    auto alloca = createEntryBlockAlloca(fn, var);
-    TheBuilder->CreateStore(initVal, alloca);
-    oldValues[var] = NamedValues[var];
-    NamedValues[var] = alloca;
+Value *VarExprAST::codegen(CodegenContext &ctx) {
+  DenseMap<Symbol, llvm::AllocaInst *> oldValues;
+  auto fn = ctx.builder->GetInsertBlock()->getParent();
+  for (auto [var, init] : varNames_) {
+    auto initVal = init ? init->codegen(ctx)
+                        : ConstantFP::get(*ctx.llvmContext, APFloat(0.0));
+    auto alloca = createEntryBlockAlloca(fn, var.getName());
+    ctx.builder->CreateStore(initVal, alloca);
+    oldValues[var] = ctx.namedValues[var];
+    ctx.namedValues[var] = alloca;
   }
 
-  auto result = body_->codegen();
+  auto result = body_->codegen(ctx);
 
-  for (auto &[var, _] : varNames_) {
+  for (auto [var, _] : varNames_) {
     if (oldValues[var]) {
-      NamedValues[var] = oldValues[var];
+      ctx.namedValues[var] = oldValues[var];
     } else {
-      NamedValues.erase(var);
+      ctx.namedValues.erase(var);
     }
   }
   return result;
 }
 
-Value *UnaryExprAST::codegen() {
-  auto operand = operand_->codegen();
-  auto unOpName = std::string("unary") + op_;
-  auto fn = getFunction(unOpName);
+Value *UnaryExprAST::codegen(CodegenContext &ctx) {
+  auto operand = operand_->codegen(ctx);
+  auto unOpName = TheSymbols.getUnaryOperator(op_);
+  auto fn = ctx.getFunction(unOpName);
   if (!fn) {
-    throw CodegenException("Unary operator " + unOpName + "not found!");
+    throw CodegenException("Unary operator " + unOpName.getName().str() +
+                           "not found!");
   }
-  return TheBuilder->CreateCall(fn, operand, "unop");
+  return ctx.builder->CreateCall(fn, operand, "unop");
 }
 
-Value *BinaryExprAST::codegen() {
+Value *BinaryExprAST::codegen(CodegenContext &ctx) {
   if (op_ == '=') {
-    auto lhse = static_cast<VariableExprAST *>(lhs_.get());
+    auto lhse = dyn_cast<VariableExprAST>(lhs_);
     if (!lhse) {
       throw CodegenException("Destination of '=' must be a variable");
     }
 
-    auto rhs = rhs_->codegen();
-    if (!NamedValues.contains(lhse->getName())) {
-      throw CodegenException("Unknown variable name: " + lhse->getName());
+    auto rhs = rhs_->codegen(ctx);
+    auto alloca = ctx.namedValues.lookup(lhse->getName());
+    if (!alloca) {
+      throw CodegenException("Unknown variable name: " +
+                             lhse->getName().getName().str());
     }
-    auto alloca = NamedValues[lhse->getName()];
-    TheBuilder->CreateStore(rhs, alloca);
+    ctx.builder->CreateStore(rhs, alloca);
     return rhs;
   }
 
-  auto lhs = lhs_->codegen();
-  auto rhs = rhs_->codegen();
+  auto lhs = lhs_->codegen(ctx);
+  auto rhs = rhs_->codegen(ctx);
   switch (op_) {
   case '+':
-    return TheBuilder->CreateFAdd(lhs, rhs);
+    return ctx.builder->CreateFAdd(lhs, rhs);
   case '-':
-    return TheBuilder->CreateFSub(lhs, rhs);
+    return ctx.builder->CreateFSub(lhs, rhs);
   case '*':
-    return TheBuilder->CreateFMul(lhs, rhs);
+    return ctx.builder->CreateFMul(lhs, rhs);
   case '<': {
-    auto cmp = TheBuilder->CreateFCmpULT(lhs, rhs);
-    return TheBuilder->CreateUIToFP(cmp, Type::getDoubleTy(*TheContext));
+    auto cmp = ctx.builder->CreateFCmpULT(lhs, rhs);
+    return ctx.builder->CreateUIToFP(cmp, Type::getDoubleTy(*ctx.llvmContext));
   }
   default:
     break;
   }
 
   // Emit calls for user defined operators
-  std::string binOpName = std::string("binary") + op_;
-  Function *fn = getFunction(binOpName);
+  Symbol binOpName = TheSymbols.getBinaryOperator(op_);
+  Function *fn = ctx.getFunction(binOpName);
   if (!fn) {
-    throw CodegenException("Binary operator " + binOpName + " not found!");
+    throw CodegenException("Binary operator " + binOpName.getName().str() +
+                           " not found!");
   }
 
-  return TheBuilder->CreateCall(fn, {lhs, rhs}, "binop");
+  return ctx.builder->CreateCall(fn, {lhs, rhs}, "binop");
 }
 
-Value *IfExprAST::codegen() {
-  auto cond = cond_->codegen();
-  cond = TheBuilder->CreateFCmpONE(cond,
-                                   ConstantFP::get(*TheContext, APFloat(0.0)));
+Value *IfExprAST::codegen(CodegenContext &ctx) {
+  auto cond = cond_->codegen(ctx);
+  cond = ctx.builder->CreateFCmpONE(
+      cond, ConstantFP::get(*ctx.llvmContext, APFloat(0.0)));
 
-  auto fn = TheBuilder->GetInsertBlock()->getParent();
+  auto fn = ctx.builder->GetInsertBlock()->getParent();
 
-  auto thenBB = BasicBlock::Create(*TheContext, "then", fn);
-  auto elseBB = BasicBlock::Create(*TheContext, "else");
-  auto mergeBB = BasicBlock::Create(*TheContext, "merge");
-  TheBuilder->CreateCondBr(cond, thenBB, elseBB);
+  auto thenBB = BasicBlock::Create(*ctx.llvmContext, "then", fn);
+  auto elseBB = BasicBlock::Create(*ctx.llvmContext, "else");
+  auto mergeBB = BasicBlock::Create(*ctx.llvmContext, "merge");
+  ctx.builder->CreateCondBr(cond, thenBB, elseBB);
 
-  TheBuilder->SetInsertPoint(thenBB);
-  auto thenValue = then_->codegen();
-  TheBuilder->CreateBr(mergeBB);
-  thenBB = TheBuilder->GetInsertBlock();
+  ctx.builder->SetInsertPoint(thenBB);
+  auto thenValue = then_->codegen(ctx);
+  ctx.builder->CreateBr(mergeBB);
+  thenBB = ctx.builder->GetInsertBlock();
 
   fn->insert(fn->end(), elseBB);
-  TheBuilder->SetInsertPoint(elseBB);
-  auto elseValue = else_->codegen();
-  TheBuilder->CreateBr(mergeBB);
-  elseBB = TheBuilder->GetInsertBlock();
+  ctx.builder->SetInsertPoint(elseBB);
+  auto elseValue = else_->codegen(ctx);
+  ctx.builder->CreateBr(mergeBB);
+  elseBB = ctx.builder->GetInsertBlock();
 
   fn->insert(fn->end(), mergeBB);
-  TheBuilder->SetInsertPoint(mergeBB);
+  ctx.builder->SetInsertPoint(mergeBB);
   auto phiNode =
-      TheBuilder->CreatePHI(Type::getDoubleTy(*TheContext), 2, "iftmp");
+      ctx.builder->CreatePHI(Type::getDoubleTy(*ctx.llvmContext), 2, "iftmp");
   phiNode->addIncoming(thenValue, thenBB);
   phiNode->addIncoming(elseValue, elseBB);
   return phiNode;
 }
 
-Value *ForExprAST::codegen() {
-  auto fn = TheBuilder->GetInsertBlock()->getParent();
-  auto alloca = createEntryBlockAlloca(fn, varName_);
-  auto start = start_->codegen();
-  TheBuilder->CreateStore(start, alloca);
+Value *ForExprAST::codegen(CodegenContext &ctx) {
+  auto fn = ctx.builder->GetInsertBlock()->getParent();
+  auto alloca = createEntryBlockAlloca(fn, varName_.getName());
+  auto start = start_->codegen(ctx);
+  ctx.builder->CreateStore(start, alloca);
 
   // Create block for condition.
-  auto loopBB = BasicBlock::Create(*TheContext, "loop", fn);
-  TheBuilder->CreateBr(loopBB);
-  TheBuilder->SetInsertPoint(loopBB);
+  auto loopBB = BasicBlock::Create(*ctx.llvmContext, "loop", fn);
+  ctx.builder->CreateBr(loopBB);
+  ctx.builder->SetInsertPoint(loopBB);
 
   // Store variable name in environment temporarily when doing codegen for body.
-  auto oldVal = NamedValues[varName_];
-  NamedValues[varName_] = alloca;
+  auto oldVal = ctx.namedValues[varName_];
+  ctx.namedValues[varName_] = alloca;
 
-  body_->codegen();
-  auto step =
-      step_ ? step_->codegen() : ConstantFP::get(*TheContext, APFloat(1.0));
-  auto end = end_->codegen();
+  body_->codegen(ctx);
+  auto step = step_ ? step_->codegen(ctx)
+                    : ConstantFP::get(*ctx.llvmContext, APFloat(1.0));
+  auto end = end_->codegen(ctx);
 
-  auto nextVar = TheBuilder->CreateFAdd(
-      TheBuilder->CreateLoad(alloca->getAllocatedType(), alloca, varName_),
+  auto nextVar = ctx.builder->CreateFAdd(
+      ctx.builder->CreateLoad(alloca->getAllocatedType(), alloca,
+                              varName_.getName()),
       step);
-  TheBuilder->CreateStore(nextVar, alloca);
+  ctx.builder->CreateStore(nextVar, alloca);
 
-  end = TheBuilder->CreateFCmpONE(
-      end, ConstantFP::get(*TheContext, APFloat(0.0)), "loopcond");
+  end = ctx.builder->CreateFCmpONE(
+      end, ConstantFP::get(*ctx.llvmContext, APFloat(0.0)), "loopcond");
 
-  auto afterBB = BasicBlock::Create(*TheContext, "afterloop", fn);
-  TheBuilder->CreateCondBr(end, loopBB, afterBB);
-  TheBuilder->SetInsertPoint(afterBB);
+  auto afterBB = BasicBlock::Create(*ctx.llvmContext, "afterloop", fn);
+  ctx.builder->CreateCondBr(end, loopBB, afterBB);
+  ctx.builder->SetInsertPoint(afterBB);
 
   // Restore old variable name in environment.
   if (oldVal) {
-    NamedValues[varName_] = oldVal;
+    ctx.namedValues[varName_] = oldVal;
   } else {
-    NamedValues.erase(varName_);
+    ctx.namedValues.erase(varName_);
   }
 
-  return Constant::getNullValue(Type::getDoubleTy(*TheContext));
+  return Constant::getNullValue(Type::getDoubleTy(*ctx.llvmContext));
 }
 
-Value *CallExprAST::codegen() {
-  auto fn = getFunction(callee_);
+Value *CallExprAST::codegen(CodegenContext &ctx) {
+  auto fn = ctx.getFunction(callee_);
   if (!fn) {
-    throw CodegenException("Function " + callee_ +
+    throw CodegenException("Function " + callee_.getName().str() +
                            " can't be found in the module");
   }
   if (fn->arg_size() != args_.size()) {
@@ -247,32 +289,33 @@ Value *CallExprAST::codegen() {
   }
 
   std::vector<Value *> args;
-  for (auto &arg : args_) {
-    args.push_back(arg->codegen());
+  for (auto arg : args_) {
+    args.push_back(arg->codegen(ctx));
   }
-  return TheBuilder->CreateCall(fn, args);
+  return ctx.builder->CreateCall(fn, args);
 }
 
-Function *PrototypeAST::codegen() {
-  std::vector<Type *> argTypes(args_.size(), Type::getDoubleTy(*TheContext));
+Function *PrototypeAST::codegen(CodegenContext &ctx) const {
+  std::vector<Type *> argTypes(args_.size(),
+                               Type::getDoubleTy(*ctx.llvmContext));
   auto functionType =
-      FunctionType::get(Type::getDoubleTy(*TheContext), argTypes, false);
+      FunctionType::get(Type::getDoubleTy(*ctx.llvmContext), argTypes, false);
   // Can do this or:
   // auto fn = dyn_cast<Function>(TheModule->getOrInsertFunction(name_,
   // functionType).getCallee());
-  auto fn = Function::Create(functionType, Function::ExternalLinkage, name_,
-                             *TheModule);
+  auto fn = Function::Create(functionType, Function::ExternalLinkage,
+                             getName(), *ctx.irModule);
   unsigned i = 0;
   for (auto &arg : fn->args()) {
-    arg.setName(args_[i++]);
+    arg.setName(args_[i++].getName());
   }
   return fn;
 }
 
-Function *FunctionAST::codegen(std::unordered_map<char, int> &binopPrecedence) {
+Function *FunctionAST::codegen(CodegenContext &ctx) const {
   const auto &proto = *prototype_;
-  FunctionProtos[prototype_->getName()] = std::move(prototype_);
-  auto fn = getFunction(proto.getName());
+  ctx.protos.add(prototype_);
+  auto fn = ctx.getFunction(proto.getSymbol());
   if (!fn) {
     throw CodegenException("Could not find function");
   }
@@ -280,25 +323,21 @@ Function *FunctionAST::codegen(std::unordered_map<char, int> &binopPrecedence) {
     throw CodegenException("Function cannot be redefined");
   }
 
-  if (proto.isBinaryOp()) {
-    binopPrecedence[proto.getOperatorName()] = proto.getBinaryPrecedence();
-  }
-
-  auto BB = BasicBlock::Create(*TheContext, "entry", fn);
-  TheBuilder->SetInsertPoint(BB);
+  auto BB = BasicBlock::Create(*ctx.llvmContext, "entry", fn);
+  ctx.builder->SetInsertPoint(BB);
 
-  NamedValues.clear();
-  for (auto &arg : fn->args()) {
-    auto alloca = createEntryBlockAlloca(fn, arg.getName());
-    TheBuilder->CreateStore(&arg, alloca);
-    NamedValues[arg.getName()] = alloca;
+  ctx.namedValues.clear();
+  for (auto [arg, name] : zip(fn->args(), proto.getArgs())) {
+    auto alloca = createEntryBlockAlloca(fn, name.getName());
+    ctx.builder->CreateStore(&arg, alloca);
+    ctx.namedValues[name] = alloca;
   }
 
   try {
-    auto result = body_->codegen();
-    TheBuilder->CreateRet(result);
+    auto result = body_->codegen(ctx);
+    ctx.builder->CreateRet(result);
     verifyFunction(*fn);
-    TheFPM->run(*fn, *TheFAM);
+    ctx.fpm->run(*fn, *ctx.fam);
   } catch (CodegenException &e) {
     fn->eraseFromParent();
     throw;
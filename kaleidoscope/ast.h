@@ -1,6 +1,11 @@
 #ifndef AST_H
 #define AST_H
 
+#include "symbol.h"
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/ADT/StringRef.h"
 #include "llvm/Analysis/CGSCCPassManager.h"
 #include "llvm/Analysis/LoopAnalysisManager.h"
 #include "llvm/IR/IRBuilder.h"
@@ -9,155 +14,266 @@
 #include "llvm/IR/PassManager.h"
 #include "llvm/IR/Value.h"
 #include "llvm/Passes/StandardInstrumentations.h"
+#include "llvm/Support/Allocator.h"
 #include <memory>
+#include <shared_mutex>
 #include <string>
-#include <unordered_map>
+#include <type_traits>
 #include <vector>
 
 class PrototypeAST;
 
-extern std::unique_ptr<llvm::LLVMContext> TheContext;
-extern std::unique_ptr<llvm::IRBuilder<>> TheBuilder;
-extern std::unique_ptr<llvm::Module> TheModule;
-extern llvm::StringMap<llvm::AllocaInst *> NamedValues;
-extern llvm::StringMap<std::unique_ptr<PrototypeAST>> FunctionProtos;
+/// @brief Prototypes of every function declared so far, shared by all
+/// codegen contexts and safe to use from several threads. A prototype is
+/// never modified once added, and lookups hand out shared pointers, so it
+/// stays valid for its user when a later declaration replaces it.
+///
+/// Every declaration gets the next version number and the older ones are
+/// kept, so a lookup limited to a version resolves names exactly as they
+/// were when that version was current, whatever is declared since.
+class PrototypeTable {
+  struct Entry {
+    uint64_t version;
+    std::shared_ptr<const PrototypeAST> proto;
+  };
 
-extern std::unique_ptr<llvm::FunctionPassManager> TheFPM;
-extern std::unique_ptr<llvm::LoopAnalysisManager> TheLAM;
-extern std::unique_ptr<llvm::FunctionAnalysisManager> TheFAM;
-extern std::unique_ptr<llvm::CGSCCAnalysisManager> TheCGAM;
-extern std::unique_ptr<llvm::ModuleAnalysisManager> TheMAM;
-extern std::unique_ptr<llvm::PassInstrumentationCallbacks> ThePIC;
-extern std::unique_ptr<llvm::StandardInstrumentations> TheSI;
+  mutable std::shared_mutex mutex_;
+  llvm::DenseMap<Symbol, llvm::SmallVector<Entry, 1>> protos_;
+  uint64_t version_ = 0;
 
-void initializeModuleAndManagers();
-void initializeModuleAndManagers(const llvm::DataLayout &layout);
+public:
+  static constexpr uint64_t Latest = UINT64_MAX;
+
+  /// @brief Declares proto, unless that very prototype was added before.
+  void add(std::shared_ptr<const PrototypeAST> proto);
+  /// @brief Returns the version of the last declaration.
+  uint64_t getVersion() const;
+  /// @brief Returns the latest prototype for name declared at or before
+  /// version.
+  std::shared_ptr<const PrototypeAST> lookup(Symbol name,
+                                             uint64_t version = Latest) const;
+};
+
+/// @brief State of the code generation of one module, passed to every
+/// codegen() instead of living in globals. Each context has its own
+/// LLVMContext and pass managers, so contexts on different threads generate
+/// and optimize code concurrently. They only share the prototype table.
+class CodegenContext {
+public:
+  PrototypeTable &protos;
+  std::unique_ptr<llvm::LLVMContext> llvmContext;
+  std::unique_ptr<llvm::IRBuilder<>> builder;
+  std::unique_ptr<llvm::Module> irModule;
+  llvm::DenseMap<Symbol, llvm::AllocaInst *> namedValues;
+  // Last version of protos this context resolves calls against.
+  uint64_t protosVersion = PrototypeTable::Latest;
+
+  std::unique_ptr<llvm::FunctionPassManager> fpm;
+  std::unique_ptr<llvm::LoopAnalysisManager> lam;
+  std::unique_ptr<llvm::FunctionAnalysisManager> fam;
+  std::unique_ptr<llvm::CGSCCAnalysisManager> cgam;
+  std::unique_ptr<llvm::ModuleAnalysisManager> mam;
+  std::unique_ptr<llvm::PassInstrumentationCallbacks> pic;
+  std::unique_ptr<llvm::StandardInstrumentations> si;
 
+  explicit CodegenContext(PrototypeTable &protos) : protos(protos) { reset(); }
+  /// @brief Starts a new module in a new LLVMContext, after the previous
+  /// ones have been moved out, e.g. to the JIT.
+  void reset();
+  void reset(const llvm::DataLayout &layout);
+  /// @brief Returns the function with the given name in the module, declaring
+  /// it from its prototype if needed, or null if it was never declared.
+  llvm::Function *getFunction(Symbol name);
+};
+
+/// @brief Arena the expressions of one top-level item are allocated in.
+///
+/// Nodes are bump allocated and never destroyed one by one, so they may only
+/// hold trivially destructible members: names are symbols and child lists
+/// are copied into the arena too. reset() frees everything at once after the
+/// item has been emitted.
+class ASTArena {
+  llvm::BumpPtrAllocator allocator_;
+
+public:
+  template <typename T, typename... Args> T *create(Args &&...args) {
+    static_assert(std::is_trivially_destructible_v<T>,
+                  "arena nodes are never destroyed");
+    return new (allocator_.Allocate<T>()) T(std::forward<Args>(args)...);
+  }
+  template <typename T> llvm::ArrayRef<T> copyArray(llvm::ArrayRef<T> array) {
+    T *data = allocator_.Allocate<T>(array.size());
+    std::uninitialized_copy(array.begin(), array.end(), data);
+    return llvm::ArrayRef<T>(data, array.size());
+  }
+  void reset() { allocator_.Reset(); }
+};
+
+/// @brief Base of the expression nodes. Nodes are told apart by their kind
+/// instead of a vtable, so they support isa<> and dyn_cast<> through
+/// classof() and codegen() dispatches with a switch.
 class ExprAST {
 public:
-  virtual ~ExprAST() = default;
-  virtual llvm::Value *codegen() = 0;
+  enum class Kind : uint8_t {
+    Number,
+    Variable,
+    Var,
+    Binary,
+    Unary,
+    If,
+    For,
+    Call
+  };
+
+private:
+  const Kind kind_;
+
+protected:
+  explicit ExprAST(Kind kind) : kind_(kind) {}
+
+public:
+  Kind getKind() const { return kind_; }
+  llvm::Value *codegen(CodegenContext &ctx);
 };
 
 class NumberExprAST : public ExprAST {
   double val_;
 
 public:
-  explicit NumberExprAST(double val) : val_(val) {}
-  llvm::Value *codegen() override;
+  explicit NumberExprAST(double val) : ExprAST(Kind::Number), val_(val) {}
+  llvm::Value *codegen(CodegenContext &ctx);
+  static bool classof(const ExprAST *e) { return e->getKind() == Kind::Number; }
 };
 
 /// @brief Expression for referencing defined variables.
 class VariableExprAST : public ExprAST {
-  std::string name_;
+  Symbol name_;
 
 public:
-  const std::string &getName() { return name_; }
-  explicit VariableExprAST(const std::string &name) : name_(name) {}
-  llvm::Value *codegen() override;
+  Symbol getName() const { return name_; }
+  explicit VariableExprAST(Symbol name)
+      : ExprAST(Kind::Variable), name_(name) {}
+  llvm::Value *codegen(CodegenContext &ctx);
+  static bool classof(const ExprAST *e) {
+    return e->getKind() == Kind::Variable;
+  }
+};
+
+/// @brief A variable of a var expression with its optional initializer.
+struct VarBinding {
+  Symbol name;
+  ExprAST *init;
 };
 
 /// @brief Expression for creating new locally defined variables.
 class VarExprAST : public ExprAST {
-  std::vector<std::pair<std::string, std::unique_ptr<ExprAST>>> varNames_;
-  std::unique_ptr<ExprAST> body_;
+  llvm::ArrayRef<VarBinding> varNames_;
+  ExprAST *body_;
 
 public:
-  VarExprAST(
-      std::vector<std::pair<std::string, std::unique_ptr<ExprAST>>> varNames,
-      std::unique_ptr<ExprAST> body)
-      : varNames_(std::move(varNames)), body_(std::move(body)) {}
-  llvm::Value *codegen() override;
+  VarExprAST(llvm::ArrayRef<VarBinding> varNames, ExprAST *body)
+      : ExprAST(Kind::Var), varNames_(varNames), body_(body) {}
+  llvm::Value *codegen(CodegenContext &ctx);
+  static bool classof(const ExprAST *e) { return e->getKind() == Kind::Var; }
 };
 
 class BinaryExprAST : public ExprAST {
   char op_;
-  std::unique_ptr<ExprAST> lhs_, rhs_;
+  ExprAST *lhs_, *rhs_;
 
 public:
-  BinaryExprAST(char op, std::unique_ptr<ExprAST> lhs,
-                std::unique_ptr<ExprAST> rhs)
-      : op_(op), lhs_(std::move(lhs)), rhs_(std::move(rhs)) {}
-  llvm::Value *codegen() override;
+  BinaryExprAST(char op, ExprAST *lhs, ExprAST *rhs)
+      : ExprAST(Kind::Binary), op_(op), lhs_(lhs), rhs_(rhs) {}
+  llvm::Value *codegen(CodegenContext &ctx);
+  static bool classof(const ExprAST *e) { return e->getKind() == Kind::Binary; }
 };
 
 class UnaryExprAST : public ExprAST {
   char op_;
-  std::unique_ptr<ExprAST> operand_;
+  ExprAST *operand_;
 
 public:
-  UnaryExprAST(char op, std::unique_ptr<ExprAST> operand)
-      : op_(op), operand_(std::move(operand)) {}
-  llvm::Value *codegen() override;
+  UnaryExprAST(char op, ExprAST *operand)
+      : ExprAST(Kind::Unary), op_(op), operand_(operand) {}
+  llvm::Value *codegen(CodegenContext &ctx);
+  static bool classof(const ExprAST *e) { return e->getKind() == Kind::Unary; }
 };
 
 class IfExprAST : public ExprAST {
-  std::unique_ptr<ExprAST> cond_, then_, else_;
+  ExprAST *cond_, *then_, *else_;
 
 public:
-  IfExprAST(std::unique_ptr<ExprAST> Cond, std::unique_ptr<ExprAST> Then,
-            std::unique_ptr<ExprAST> Else)
-      : cond_(std::move(Cond)), then_(std::move(Then)), else_(std::move(Else)) {
-  }
-  llvm::Value *codegen() override;
+  IfExprAST(ExprAST *Cond, ExprAST *Then, ExprAST *Else)
+      : ExprAST(Kind::If), cond_(Cond), then_(Then), else_(Else) {}
+  llvm::Value *codegen(CodegenContext &ctx);
+  static bool classof(const ExprAST *e) { return e->getKind() == Kind::If; }
 };
 
 class ForExprAST : public ExprAST {
-  std::string varName_;
-  std::unique_ptr<ExprAST> start_, end_, step_, body_;
+  Symbol varName_;
+  ExprAST *start_, *end_, *step_, *body_;
 
 public:
-  ForExprAST(const std::string &varName, std::unique_ptr<ExprAST> start,
-             std::unique_ptr<ExprAST> end, std::unique_ptr<ExprAST> step,
-             std::unique_ptr<ExprAST> body)
-      : varName_(varName), start_(std::move(start)), end_(std::move(end)),
-        step_(std::move(step)), body_(std::move(body)) {}
-  llvm::Value *codegen() override;
+  ForExprAST(Symbol varName, ExprAST *start, ExprAST *end,
+             ExprAST *step, ExprAST *body)
+      : ExprAST(Kind::For), varName_(varName), start_(start), end_(end),
+        step_(step), body_(body) {}
+  llvm::Value *codegen(CodegenContext &ctx);
+  static bool classof(const ExprAST *e) { return e->getKind() == Kind::For; }
 };
 
 class CallExprAST : public ExprAST {
-  std::string callee_;
-  std::vector<std::unique_ptr<ExprAST>> args_;
+  Symbol callee_;
+  llvm::ArrayRef<ExprAST *> args_;
 
 public:
-  CallExprAST(const std::string &callee,
-              std::vector<std::unique_ptr<ExprAST>> args)
-      : callee_(callee), args_(std::move(args)) {}
-  llvm::Value *codegen() override;
+  CallExprAST(Symbol callee, llvm::ArrayRef<ExprAST *> args)
+      : ExprAST(Kind::Call), callee_(callee), args_(args) {}
+  llvm::Value *codegen(CodegenContext &ctx);
+  static bool classof(const ExprAST *e) { return e->getKind() == Kind::Call; }
 };
 
+/// @brief Prototypes outlive the item they are parsed in, since they are
+/// kept in the PrototypeTable, so unlike the expressions they are not allocated
+/// in the arena.
 class PrototypeAST {
-  std::string name_;
-  std::vector<std::string> args_;
+  Symbol name_;
+  std::vector<Symbol> args_;
   bool isOperator_;
   unsigned precedence_;
 
 public:
-  PrototypeAST(const std::string &name, std::vector<std::string> args,
+  PrototypeAST(Symbol name, std::vector<Symbol> args,
                bool isOperator = false, unsigned precedence = 0)
       : name_(name), args_(std::move(args)), isOperator_(isOperator),
         precedence_(precedence) {}
 
-  const std::string &getName() const noexcept { return name_; }
+  Symbol getSymbol() const noexcept { return name_; }
+  llvm::StringRef getName() const { return name_.getName(); }
+  llvm::ArrayRef<Symbol> getArgs() const noexcept { return args_; }
   bool isUnaryOp() const noexcept { return isOperator_ && args_.size() == 1; }
   bool isBinaryOp() const noexcept { return isOperator_ && args_.size() == 2; }
   char getOperatorName() const {
     assert(isUnaryOp() || isBinaryOp());
-    return name_[name_.size() - 1];
+    return getName().back();
   }
   unsigned getBinaryPrecedence() const noexcept { return precedence_; }
-  llvm::Function *codegen();
+  llvm::Function *codegen(CodegenContext &ctx) const;
 };
 
+/// @brief A function definition. The body lives in the parser's arena, so
+/// the definition has to be emitted before the arena is reset.
 class FunctionAST {
-  std::unique_ptr<PrototypeAST> prototype_;
-  std::unique_ptr<ExprAST> body_;
+  std::shared_ptr<const PrototypeAST> prototype_;
+  ExprAST *body_;
 
 public:
-  FunctionAST(std::unique_ptr<PrototypeAST> prototype,
-              std::unique_ptr<ExprAST> body)
-      : prototype_(std::move(prototype)), body_(std::move(body)) {}
-  llvm::Function *codegen(std::unordered_map<char, int> &binopPrecedence);
+  FunctionAST(std::shared_ptr<const PrototypeAST> prototype, ExprAST *body)
+      : prototype_(std::move(prototype)), body_(body) {}
+  const std::shared_ptr<const PrototypeAST> &getPrototype() const {
+    return prototype_;
+  }
+  llvm::Function *codegen(CodegenContext &ctx) const;
 };
 
 class CodegenException : public std::exception {
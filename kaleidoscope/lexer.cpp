@@ -1,70 +1,168 @@
 #include "lexer.h"
-#include <iostream>
+#include <array>
+#include <cerrno>
+#include <charconv>
+#include <cstring>
+#include <unistd.h>
 
-Token Lexer::getTok() {
-  while (isspace(lastChar_)) {
-    lastChar_ = in_.get();
+namespace {
+
+enum CharClass : unsigned char {
+  Space = 1,
+  Alpha = 2,
+  Digit = 4,
+  Dot = 8,
+};
+
+constexpr std::array<unsigned char, 256> charClasses = [] {
+  std::array<unsigned char, 256> classes{};
+  for (unsigned char c : {' ', '\t', '\n', '\v', '\f', '\r'}) {
+    classes[c] = Space;
+  }
+  for (int c = 'a'; c <= 'z'; ++c) {
+    classes[c] = Alpha;
+    classes[c - 'a' + 'A'] = Alpha;
+  }
+  for (int c = '0'; c <= '9'; ++c) {
+    classes[c] = Digit;
   }
+  classes['.'] = Dot;
+  return classes;
+}();
 
-  if (isalpha(lastChar_)) {
-    identifier_.assign(1, lastChar_);
-    while (isalnum((lastChar_ = in_.get()))) {
-      identifier_ += lastChar_;
-    }
-    if (identifier_ == "def") {
-      return Token::Def;
-    }
-    if (identifier_ == "extern") {
-      return Token::Extern;
-    }
-    if (identifier_ == "if") {
-      return Token::If;
-    }
-    if (identifier_ == "then") {
-      return Token::Then;
-    }
-    if (identifier_ == "else") {
-      return Token::Else;
-    }
-    if (identifier_ == "for") {
-      return Token::For;
-    }
-    if (identifier_ == "in") {
-      return Token::In;
+inline bool is(char c, unsigned char classes) {
+  return charClasses[static_cast<unsigned char>(c)] & classes;
+}
+
+struct Keyword {
+  std::string_view name;
+  Token token;
+};
+
+/// @brief Perfect hash of the keywords: no two of them share a slot, so an
+/// identifier is a keyword only if it equals the one in its slot.
+constexpr unsigned keywordHash(std::string_view word) {
+  return (static_cast<unsigned char>(word.front()) +
+          static_cast<unsigned char>(word.back()) + 2 * word.size()) %
+         32;
+}
+
+constexpr std::array<Keyword, 32> keywords = [] {
+  std::array<Keyword, 32> table{};
+  for (auto keyword : {Keyword{"def", Token::Def},
+                       Keyword{"extern", Token::Extern},
+                       Keyword{"if", Token::If}, Keyword{"then", Token::Then},
+                       Keyword{"else", Token::Else}, Keyword{"for", Token::For},
+                       Keyword{"in", Token::In},
+                       Keyword{"binary", Token::Binary},
+                       Keyword{"unary", Token::Unary},
+                       Keyword{"var", Token::Var}}) {
+    auto &slot = table[keywordHash(keyword.name)];
+    if (!slot.name.empty()) {
+      throw "keywordHash is not perfect";
     }
-    if (identifier_ == "binary") {
-      return Token::Binary;
+    slot = keyword;
+  }
+  return table;
+}();
+
+constexpr size_t BlockSize = 64 * 1024;
+
+} // namespace
+
+Lexer::Lexer(std::unique_ptr<llvm::MemoryBuffer> file)
+    : file_(std::move(file)), fd_(-1), cur_(file_->getBufferStart()),
+      end_(file_->getBufferEnd()), numberValue_(0) {}
+
+Lexer::Lexer(int fd)
+    : block_(BlockSize), fd_(fd), cur_(block_.data()), end_(block_.data()),
+      numberValue_(0) {
+  block_[0] = '\0';
+}
+
+/// @brief Reads the next block of input, keeping the characters from start
+/// on. Updates start and cur_ to where they moved. Returns false at the end
+/// of the input.
+bool Lexer::refill(const char *&start) {
+  if (fd_ < 0) {
+    return false;
+  }
+  size_t keep = end_ - start;
+  size_t position = cur_ - start;
+  if (keep + BlockSize / 2 > block_.size()) {
+    std::vector<char> grown(2 * block_.size());
+    memcpy(grown.data(), start, keep);
+    block_ = std::move(grown);
+  } else {
+    memmove(block_.data(), start, keep);
+  }
+  start = block_.data();
+  cur_ = start + position;
+
+  ssize_t numRead;
+  do {
+    numRead = read(fd_, block_.data() + keep, block_.size() - keep - 1);
+  } while (numRead < 0 && errno == EINTR);
+  end_ = block_.data() + keep + std::max<ssize_t>(numRead, 0);
+  block_[end_ - block_.data()] = '\0';
+  return numRead > 0;
+}
+
+/// @brief Advances cur_ past the characters in the given classes, reading
+/// more input at the end of the buffer. Returns start, moved along with the
+/// buffer. The buffer is null terminated and '\0' is in no class, so the
+/// inner loop needs no bounds check.
+const char *Lexer::scan(const char *start, unsigned char classes) {
+  while (true) {
+    while (is(*cur_, classes)) {
+      ++cur_;
     }
-    if (identifier_ == "unary") {
-      return Token::Unary;
+    if (cur_ != end_ || !refill(start)) {
+      return start;
     }
-    if (identifier_ == "var") {
-      return Token::Var;
+  }
+}
+
+Token Lexer::getTok() {
+  scan(cur_, Space);
+  if (cur_ == end_) {
+    return Token::Eof;
+  }
+
+  if (is(*cur_, Alpha)) {
+    const char *start = scan(cur_, Alpha | Digit);
+    std::string_view identifier(start, cur_ - start);
+    const auto &keyword = keywords[keywordHash(identifier)];
+    if (keyword.name == identifier) {
+      return keyword.token;
     }
+    symbol_ = TheSymbols.intern(identifier);
     return Token::Identifier;
   }
-  if (isdigit(lastChar_) || lastChar_ == '.') {
-    std::string numStr;
-    do {
-      numStr += lastChar_;
-      lastChar_ = in_.get();
-    } while (isdigit(lastChar_) || lastChar_ == '.');
-    numberValue_ = strtod(numStr.c_str(), 0);
+  if (is(*cur_, Digit | Dot)) {
+    const char *start = scan(cur_, Digit | Dot);
+    // Like strtod, parse the longest prefix that is a number, so "1.2.3" is
+    // 1.2 and "." is 0.
+    numberValue_ = 0;
+    std::from_chars(start, cur_, numberValue_);
     return Token::Number;
   }
-  if (lastChar_ == '#') {
-    do {
-      lastChar_ = in_.get();
-    } while (lastChar_ != EOF && lastChar_ != '\n' && lastChar_ != '\r');
-    if (lastChar_ != EOF) {
-      return getTok();
+  if (*cur_ == '#') {
+    // Comments run until the end of the line. strcspn stops at the
+    // terminator too, which is either the end of the buffer or a '\0' in the
+    // comment.
+    while (true) {
+      cur_ += strcspn(cur_, "\n\r");
+      if (cur_ != end_) {
+        if (*cur_ != '\0') {
+          return getTok();
+        }
+        ++cur_;
+      } else if (!refill(cur_)) {
+        return Token::Eof;
+      }
     }
   }
-  if (lastChar_ == EOF) {
-    return Token::Eof;
-  }
 
-  Token tok(static_cast<Token>(lastChar_));
-  lastChar_ = in_.get();
-  return tok;
+  return static_cast<Token>(static_cast<unsigned char>(*cur_++));
 }
\ No newline at end of file
@@ -1,7 +1,11 @@
 #ifndef LEXER_H
 #define LEXER_H
 
-#include <string>
+#include "symbol.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include <memory>
+#include <string_view>
+#include <vector>
 
 enum class Token {
   Eof = -1,
@@ -19,15 +23,30 @@ enum class Token {
   Var = -13
 };
 
+/// @brief Lexer over a contiguous, null terminated buffer.
+///
+/// A file is memory mapped as a whole. Other input, like an interactive
+/// stdin, is read in blocks as it becomes available, so the REPL still
+/// answers every line as soon as it is typed.
 class Lexer {
-  std::istream &in_;
-  int lastChar_;
-  std::string identifier_;
+  // The whole input, if it is a file.
+  std::unique_ptr<llvm::MemoryBuffer> file_;
+  // The current block, if the input is read in blocks from fd_.
+  std::vector<char> block_;
+  int fd_;
+  const char *cur_;
+  const char *end_;
+  // The identifier, interned as it is lexed.
+  Symbol symbol_;
   double numberValue_;
 
+  bool refill(const char *&start);
+  const char *scan(const char *start, unsigned char classes);
+
 public:
-  explicit Lexer(std::istream &in) : in_(in), lastChar_(' '), numberValue_(0) {}
-  const std::string &getIdentifier() const { return identifier_; }
+  explicit Lexer(std::unique_ptr<llvm::MemoryBuffer> file);
+  explicit Lexer(int fd);
+  Symbol getSymbol() const { return symbol_; }
   double getNumber() const { return numberValue_; }
   Token getTok();
 };
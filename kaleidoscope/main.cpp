@@ -6,14 +6,31 @@
 #include "llvm/Target/TargetMachine.h"
 #include "llvm/Target/TargetOptions.h"
 #include "llvm/TargetParser/Host.h"
+#include <cstdlib>
 #include <cstring>
 #include <iostream>
+#include <unistd.h>
 #include <unordered_map>
 
 int main(int argc, char **argv) {
   bool useJIT = true;
-  if (argc > 1 && strcmp(argv[1], "--compile") == 0) {
-    useJIT = false;
+  // Definitions are only compiled concurrently with --compile, the JIT runs
+  // every item in order.
+  unsigned threads = 1;
+  // Compiles every function the first time it is called, instead of a whole
+  // module the first time anything in it is looked up.
+  bool lazy = false;
+  const char *inputFilename = nullptr;
+  for (int i = 1; i < argc; ++i) {
+    if (strcmp(argv[i], "--compile") == 0) {
+      useJIT = false;
+    } else if (strcmp(argv[i], "--lazy") == 0) {
+      lazy = true;
+    } else if (strncmp(argv[i], "--threads=", 10) == 0) {
+      threads = atoi(argv[i] + 10);
+    } else {
+      inputFilename = argv[i];
+    }
   }
 
   llvm::InitializeAllTargetInfos();
@@ -28,9 +45,21 @@ int main(int argc, char **argv) {
   binopPrecedence['+'] = 20;
   binopPrecedence['-'] = 20;
   binopPrecedence['*'] = 40;
-  Lexer lexer(std::cin);
-  Parser parser(lexer, std::move(binopPrecedence));
-  Driver driver(std::cout, parser, useJIT);
+  // Files are memory mapped, stdin is read in blocks as it is typed.
+  std::unique_ptr<Lexer> lexer;
+  if (inputFilename) {
+    auto file = llvm::MemoryBuffer::getFile(inputFilename);
+    if (!file) {
+      llvm::errs() << "Could not open " << inputFilename << ": "
+                   << file.getError().message() << "\n";
+      return 1;
+    }
+    lexer = std::make_unique<Lexer>(std::move(*file));
+  } else {
+    lexer = std::make_unique<Lexer>(STDIN_FILENO);
+  }
+  Parser parser(*lexer, std::move(binopPrecedence));
+  Driver driver(std::cout, parser, useJIT, threads, lazy);
   driver.mainLoop();
 
   // Exit if in JIT mode (can't compile to object code).
@@ -38,8 +67,9 @@ int main(int argc, char **argv) {
     return 0;
   }
 
+  auto &TheModule = driver.getModule();
   auto TargetTriple = llvm::sys::getDefaultTargetTriple();
-  TheModule->setTargetTriple(TargetTriple);
+  TheModule.setTargetTriple(TargetTriple);
 
   std::string err;
   auto Target = llvm::TargetRegistry::lookupTarget(TargetTriple, err);
@@ -57,7 +87,7 @@ int main(int argc, char **argv) {
       Target->createTargetMachine(TargetTriple, CPU, Features, opt,
                                   llvm::Reloc::PIC_));
 
-  TheModule->setDataLayout(TheTargetMachine->createDataLayout());
+  TheModule.setDataLayout(TheTargetMachine->createDataLayout());
 
   auto Filename = "output.o";
   std::error_code EC;
@@ -75,7 +105,7 @@ int main(int argc, char **argv) {
     return 1;
   }
 
-  manager.run(*TheModule);
+  manager.run(TheModule);
   dest.flush();
 
   llvm::outs() << "Wrote " << Filename << "\n";
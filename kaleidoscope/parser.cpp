@@ -1,16 +1,20 @@
 #include "parser.h"
 #include "library.h"
+#include "llvm/Bitcode/BitcodeReader.h"
+#include "llvm/Bitcode/BitcodeWriter.h"
 #include "llvm/IR/Function.h"
+#include "llvm/Linker/Linker.h"
 #include "llvm/Support/raw_os_ostream.h"
 #include <cassert>
+#include <sstream>
 
-std::unique_ptr<ExprAST> Parser::parseNumberExpr() {
-  auto result = std::make_unique<NumberExprAST>(lexer_.getNumber());
+ExprAST *Parser::parseNumberExpr() {
+  auto result = arena_.create<NumberExprAST>(lexer_.getNumber());
   getNextToken();
   return result;
 }
 
-std::unique_ptr<ExprAST> Parser::parseParenExpr() {
+ExprAST *Parser::parseParenExpr() {
   getNextToken();
   auto v = parseExpression();
   if (currentToken_ != ')') {
@@ -20,17 +24,17 @@ std::unique_ptr<ExprAST> Parser::parseParenExpr() {
   return v;
 }
 
-std::unique_ptr<ExprAST> Parser::parseIdentifierExpr() {
-  std::string ident(lexer_.getIdentifier());
+ExprAST *Parser::parseIdentifierExpr() {
+  auto ident = lexer_.getSymbol();
   getNextToken();
   // Variable
   if (currentToken_ != '(') {
-    return std::make_unique<VariableExprAST>(ident);
+    return arena_.create<VariableExprAST>(ident);
   }
 
   // Call
   getNextToken();
-  std::vector<std::unique_ptr<ExprAST>> args;
+  llvm::SmallVector<ExprAST *, 8> args;
   if (currentToken_ != ')') {
     while (true) {
       args.push_back(parseExpression());
@@ -45,10 +49,11 @@ std::unique_ptr<ExprAST> Parser::parseIdentifierExpr() {
   }
 
   getNextToken();
-  return std::make_unique<CallExprAST>(ident, std::move(args));
+  return arena_.create<CallExprAST>(ident,
+                                    arena_.copyArray<ExprAST *>(args));
 }
 
-std::unique_ptr<ExprAST> Parser::parseIfExpr() {
+ExprAST *Parser::parseIfExpr() {
   getNextToken();
 
   auto Cond = parseExpression();
@@ -64,17 +69,16 @@ std::unique_ptr<ExprAST> Parser::parseIfExpr() {
   getNextToken();
 
   auto Else = parseExpression();
-  return std::make_unique<IfExprAST>(std::move(Cond), std::move(Then),
-                                     std::move(Else));
+  return arena_.create<IfExprAST>(Cond, Then, Else);
 }
 
-std::unique_ptr<ExprAST> Parser::parseForExpr() {
+ExprAST *Parser::parseForExpr() {
   getNextToken();
 
   if (static_cast<Token>(currentToken_) != Token::Identifier) {
     throw ParserException("Expected identifier after for");
   }
-  std::string idName(lexer_.getIdentifier());
+  auto idName = lexer_.getSymbol();
   getNextToken();
 
   if (currentToken_ != '=') {
@@ -91,7 +95,7 @@ std::unique_ptr<ExprAST> Parser::parseForExpr() {
   auto end = parseExpression();
 
   // The step value is optional
-  std::unique_ptr<ExprAST> step;
+  ExprAST *step = nullptr;
   if (currentToken_ == ',') {
     getNextToken();
     step = parseExpression();
@@ -103,29 +107,28 @@ std::unique_ptr<ExprAST> Parser::parseForExpr() {
   getNextToken();
 
   auto body = parseExpression();
-  return std::make_unique<ForExprAST>(idName, std::move(start), std::move(end),
-                                      std::move(step), std::move(body));
+  return arena_.create<ForExprAST>(idName, start, end, step, body);
 }
 
-std::unique_ptr<ExprAST> Parser::parseVarExpr() {
+ExprAST *Parser::parseVarExpr() {
   getNextToken();
 
-  std::vector<std::pair<std::string, std::unique_ptr<ExprAST>>> varNames;
+  llvm::SmallVector<VarBinding, 4> varNames;
   if (static_cast<Token>(currentToken_) != Token::Identifier) {
     throw ParserException("Expected identifier after the var");
   }
 
   while (true) {
-    std::string name(lexer_.getIdentifier());
+    auto name = lexer_.getSymbol();
     getNextToken();
 
-    std::unique_ptr<ExprAST> init;
+    ExprAST *init = nullptr;
     if (currentToken_ == '=') {
       getNextToken();
       init = parseExpression();
     }
 
-    varNames.push_back(std::make_pair(name, std::move(init)));
+    varNames.push_back({name, init});
     if (currentToken_ != ',') {
       break;
     }
@@ -142,10 +145,11 @@ std::unique_ptr<ExprAST> Parser::parseVarExpr() {
   getNextToken();
 
   auto body = parseExpression();
-  return std::make_unique<VarExprAST>(std::move(varNames), std::move(body));
+  return arena_.create<VarExprAST>(arena_.copyArray<VarBinding>(varNames),
+                                   body);
 }
 
-std::unique_ptr<ExprAST> Parser::parsePrimary() {
+ExprAST *Parser::parsePrimary() {
   switch (currentToken_) {
   case static_cast<int>(Token::Number):
     return parseNumberExpr();
@@ -176,12 +180,12 @@ int Parser::getTokPrecedence() {
   return tokPrec;
 }
 
-std::unique_ptr<ExprAST> Parser::parseExpression() {
+ExprAST *Parser::parseExpression() {
   auto lhs = parseUnary();
-  return parseBinOpRHS(0, std::move(lhs));
+  return parseBinOpRHS(0, lhs);
 }
 
-std::unique_ptr<ExprAST> Parser::parseUnary() {
+ExprAST *Parser::parseUnary() {
   if (!isascii(currentToken_) || currentToken_ == '(' || currentToken_ == ',') {
     return parsePrimary();
   }
@@ -189,11 +193,10 @@ std::unique_ptr<ExprAST> Parser::parseUnary() {
   char opc = currentToken_;
   getNextToken();
   auto operand = parseUnary();
-  return std::make_unique<UnaryExprAST>(opc, std::move(operand));
+  return arena_.create<UnaryExprAST>(opc, operand);
 }
 
-std::unique_ptr<ExprAST> Parser::parseBinOpRHS(int prec,
-                                               std::unique_ptr<ExprAST> lhs) {
+ExprAST *Parser::parseBinOpRHS(int prec, ExprAST *lhs) {
   while (true) {
     int tokPrec = getTokPrecedence();
     if (tokPrec < prec) {
@@ -206,10 +209,9 @@ std::unique_ptr<ExprAST> Parser::parseBinOpRHS(int prec,
     auto rhs = parseUnary();
     int nextPrec = getTokPrecedence();
     if (tokPrec < nextPrec) {
-      rhs = parseBinOpRHS(tokPrec + 1, std::move(rhs));
+      rhs = parseBinOpRHS(tokPrec + 1, rhs);
     }
-    lhs =
-        std::make_unique<BinaryExprAST>(binOp, std::move(lhs), std::move(rhs));
+    lhs = arena_.create<BinaryExprAST>(binOp, lhs, rhs);
   }
   assert(0 && "parseBinOpRHS: cannot reach here");
 }
@@ -217,13 +219,13 @@ std::unique_ptr<ExprAST> Parser::parseBinOpRHS(int prec,
 enum class ParsePrototypeType { Identifier = 0, Unary, Binary };
 
 std::unique_ptr<PrototypeAST> Parser::parsePrototype() {
-  std::string fnName;
+  Symbol fnName;
   auto kind = ParsePrototypeType::Identifier;
   unsigned binaryPrecedence = 30;
 
   switch (static_cast<Token>(currentToken_)) {
   case Token::Identifier:
-    fnName = lexer_.getIdentifier();
+    fnName = lexer_.getSymbol();
     getNextToken();
     break;
   case Token::Unary:
@@ -231,7 +233,7 @@ std::unique_ptr<PrototypeAST> Parser::parsePrototype() {
     if (!isascii(currentToken_)) {
       throw ParserException("Expected unary operator");
     }
-    fnName = std::string("unary") + static_cast<char>(currentToken_);
+    fnName = TheSymbols.getUnaryOperator(static_cast<char>(currentToken_));
     kind = ParsePrototypeType::Unary;
     getNextToken();
     break;
@@ -240,7 +242,7 @@ std::unique_ptr<PrototypeAST> Parser::parsePrototype() {
     if (!isascii(currentToken_)) {
       throw ParserException("Expected binary operator");
     }
-    fnName = std::string("binary") + static_cast<char>(currentToken_);
+    fnName = TheSymbols.getBinaryOperator(static_cast<char>(currentToken_));
     kind = ParsePrototypeType::Binary;
     getNextToken();
     if (static_cast<Token>(currentToken_) == Token::Number) {
@@ -259,9 +261,9 @@ std::unique_ptr<PrototypeAST> Parser::parsePrototype() {
     throw ParserException("Expected '(' in prototype");
   }
 
-  std::vector<std::string> argNames;
+  std::vector<Symbol> argNames;
   while (static_cast<Token>(getNextToken()) == Token::Identifier) {
-    argNames.emplace_back(lexer_.getIdentifier());
+    argNames.push_back(lexer_.getSymbol());
     getNextToken();
     if (currentToken_ == ')') {
       break;
@@ -288,14 +290,19 @@ std::unique_ptr<FunctionAST> Parser::parseDefinition() {
   getNextToken();
   auto proto = parsePrototype();
   auto expr = parseExpression();
-  return std::make_unique<FunctionAST>(std::move(proto), std::move(expr));
+  return std::make_unique<FunctionAST>(std::move(proto), expr);
+}
+
+void Parser::installOperator(const PrototypeAST &proto) {
+  if (proto.isBinaryOp()) {
+    binopPrecedence_[proto.getOperatorName()] = proto.getBinaryPrecedence();
+  }
 }
 
 std::unique_ptr<FunctionAST> Parser::parseTopLevelExpr() {
   auto expr = parseExpression();
-  auto proto =
-      std::make_unique<PrototypeAST>("__anon_expr", std::vector<std::string>());
-  return std::make_unique<FunctionAST>(std::move(proto), std::move(expr));
+  auto proto = std::make_unique<PrototypeAST>(anonExpr_, std::vector<Symbol>());
+  return std::make_unique<FunctionAST>(std::move(proto), expr);
 }
 
 std::unique_ptr<PrototypeAST> Parser::parseExtern() {
@@ -303,31 +310,38 @@ std::unique_ptr<PrototypeAST> Parser::parseExtern() {
   return parsePrototype();
 }
 
-Driver::Driver(std::ostream &out, Parser &parser, bool useJIT)
-    : out_(out), parser_(parser) {
+Driver::Driver(std::ostream &out, Parser &parser, bool useJIT,
+               unsigned threads, bool lazy)
+    : out_(out), parser_(parser), codegen_(protos_) {
   if (useJIT) {
-    jit_ = ExitOnErr(llvm::orc::KaleidoscopeJIT::Create());
+    jit_ = ExitOnErr(llvm::orc::KaleidoscopeJIT::Create(lazy));
     ExitOnErr(
         jit_->addSymbols({{"putchard", reinterpret_cast<void *>(&putchard)},
                           {"printd", reinterpret_cast<void *>(&printd)}}));
-    initializeModuleAndManagers(jit_->getDataLayout());
-  } else {
-    initializeModuleAndManagers();
+    codegen_.reset(jit_->getDataLayout());
+  } else if (threads > 1) {
+    pool_ = std::make_unique<llvm::DefaultThreadPool>(
+        llvm::hardware_concurrency(threads));
   }
 }
 
 void Driver::handleDefinition() {
   try {
     auto ast = parser_.parseDefinition();
-    auto ir = ast->codegen(parser_.binopPrecedence_);
+    if (pool_) {
+      compileDefinitionAsync(std::move(ast));
+      return;
+    }
+    auto ir = ast->codegen(codegen_);
+    parser_.installOperator(*ast->getPrototype());
     out_ << "Read function definition: ";
     llvm::raw_os_ostream rout(out_);
     ir->print(rout);
     out_ << "\n";
     if (jit_) {
       ExitOnErr(jit_->addModule(llvm::orc::ThreadSafeModule(
-          std::move(TheModule), std::move(TheContext))));
-      initializeModuleAndManagers(jit_->getDataLayout());
+          std::move(codegen_.irModule), std::move(codegen_.llvmContext))));
+      codegen_.reset(jit_->getDataLayout());
     }
   } catch (ParserException &e) {
     out_ << "Error: " << e.what() << "\n";
@@ -337,15 +351,75 @@ void Driver::handleDefinition() {
   }
 }
 
+void Driver::compileDefinitionAsync(std::unique_ptr<FunctionAST> ast) {
+  auto &definition = definitions_.emplace_back();
+  auto name = ast->getPrototype()->getSymbol();
+  if (!defined_.insert(name).second) {
+    definition.output = "Error: Function cannot be redefined\n";
+    return;
+  }
+  // Installed before the code is generated on the pool, so the items after
+  // it parse with its precedence.
+  parser_.installOperator(*ast->getPrototype());
+  // Added before the code is generated, so the definitions after it can
+  // already call it. The task only sees the prototypes declared up to its
+  // own, as the serial driver would, however far the input has been read by
+  // the time it runs.
+  protos_.add(ast->getPrototype());
+  auto version = protos_.getVersion();
+
+  pool_->async([this, &definition, version,
+                ast = std::shared_ptr<const FunctionAST>(std::move(ast))] {
+    CodegenContext ctx(protos_);
+    ctx.protosVersion = version;
+    std::ostringstream out;
+    try {
+      auto ir = ast->codegen(ctx);
+      out << "Read function definition: ";
+      llvm::raw_os_ostream rout(out);
+      ir->print(rout);
+      rout.flush();
+      out << "\n";
+      llvm::raw_svector_ostream bitcode(definition.bitcode);
+      llvm::WriteBitcodeToFile(*ctx.irModule, bitcode);
+    } catch (CodegenException &e) {
+      out << "Error: " << e.what() << "\n";
+    }
+    definition.output = out.str();
+  });
+}
+
+void Driver::finishDefinitions() {
+  if (!pool_) {
+    return;
+  }
+  pool_->wait();
+  for (auto &definition : definitions_) {
+    out_ << definition.output;
+    if (definition.bitcode.empty()) {
+      continue;
+    }
+    llvm::MemoryBufferRef buffer(
+        llvm::StringRef(definition.bitcode.data(), definition.bitcode.size()),
+        "definition");
+    auto M = ExitOnErr(llvm::parseBitcodeFile(buffer, *codegen_.llvmContext));
+    if (llvm::Linker::linkModules(*codegen_.irModule, std::move(M))) {
+      out_ << "Error: Could not link a definition\n";
+    }
+  }
+  definitions_.clear();
+  parser_.resetAST();
+}
+
 void Driver::handleExtern() {
   try {
     auto ast = parser_.parseExtern();
-    auto ir = ast->codegen();
+    auto ir = ast->codegen(codegen_);
     out_ << "Read extern: ";
     llvm::raw_os_ostream rout(out_);
     ir->print(rout);
     out_ << "\n";
-    FunctionProtos[ast->getName()] = std::move(ast);
+    protos_.add(std::move(ast));
   } catch (ParserException &e) {
     out_ << "Error: " << e.what() << "\n";
     parser_.getNextToken();
@@ -357,7 +431,7 @@ void Driver::handleExtern() {
 void Driver::handleTopLevelExpression() {
   try {
     auto ast = parser_.parseTopLevelExpr();
-    auto ir = ast->codegen(parser_.binopPrecedence_);
+    auto ir = ast->codegen(codegen_);
     out_ << "Read top-level expr: ";
     llvm::raw_os_ostream rout(out_);
     ir->print(rout);
@@ -365,10 +439,10 @@ void Driver::handleTopLevelExpression() {
 
     if (jit_) {
       auto rt = jit_->getMainJITDylib().createResourceTracker();
-      auto tsm = llvm::orc::ThreadSafeModule(std::move(TheModule),
-                                             std::move(TheContext));
+      auto tsm = llvm::orc::ThreadSafeModule(std::move(codegen_.irModule),
+                                             std::move(codegen_.llvmContext));
       ExitOnErr(jit_->addModule(std::move(tsm), rt));
-      initializeModuleAndManagers(jit_->getDataLayout());
+      codegen_.reset(jit_->getDataLayout());
 
       auto exprSymbol = ExitOnErr(jit_->lookup("__anon_expr"));
       double (*FP)() = exprSymbol.getAddress().toPtr<double (*)()>();
@@ -391,6 +465,7 @@ void Driver::mainLoop() {
     out_ << "ready> ";
     switch (static_cast<int>(parser_.getCurrentToken())) {
     case static_cast<int>(Token::Eof):
+      finishDefinitions();
       return;
     case ';':
       parser_.getNextToken();
@@ -405,5 +480,10 @@ void Driver::mainLoop() {
       handleTopLevelExpression();
       break;
     }
+    // Everything parsed for the item has been emitted, unless definitions
+    // are still being compiled on the pool.
+    if (!pool_) {
+      parser_.resetAST();
+    }
   }
 }
\ No newline at end of file
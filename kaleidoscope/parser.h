@@ -4,6 +4,10 @@
 #include "KaleidoscopeJIT.h"
 #include "ast.h"
 #include "lexer.h"
+#include "llvm/ADT/DenseSet.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/Support/ThreadPool.h"
+#include <deque>
 #include <iostream>
 #include <unordered_map>
 
@@ -11,28 +15,35 @@ class Parser {
   Lexer &lexer_;
   int currentToken_;
   std::unordered_map<char, int> binopPrecedence_;
-  friend class Driver;
+  // Expressions of the item being parsed, freed by resetAST().
+  ASTArena arena_;
+  Symbol anonExpr_;
 
 public:
   Parser(Lexer &lexer, std::unordered_map<char, int> binopPrecedence)
       : lexer_(lexer), currentToken_(0),
-        binopPrecedence_(std::move(binopPrecedence)) {}
+        binopPrecedence_(std::move(binopPrecedence)),
+        anonExpr_(TheSymbols.intern("__anon_expr")) {}
   Token getCurrentToken() { return static_cast<Token>(currentToken_); }
   int getNextToken() {
     return currentToken_ = static_cast<int>(lexer_.getTok());
   }
   int getTokPrecedence();
-  std::unique_ptr<ExprAST> parseNumberExpr();
-  std::unique_ptr<ExprAST> parseParenExpr();
-  std::unique_ptr<ExprAST> parseIdentifierExpr();
-  std::unique_ptr<ExprAST> parseIfExpr();
-  std::unique_ptr<ExprAST> parseForExpr();
-  std::unique_ptr<ExprAST> parseVarExpr();
-  std::unique_ptr<ExprAST> parsePrimary();
-  std::unique_ptr<ExprAST> parseExpression();
-  std::unique_ptr<ExprAST> parseUnary();
-  std::unique_ptr<ExprAST> parseBinOpRHS(int prec,
-                                         std::unique_ptr<ExprAST> lhs);
+  void resetAST() { arena_.reset(); }
+  /// @brief Makes a binary operator definition's precedence known to the
+  /// items parsed after it. Called once the definition is accepted, so the
+  /// operator's own body and rejected definitions don't use it.
+  void installOperator(const PrototypeAST &proto);
+  ExprAST *parseNumberExpr();
+  ExprAST *parseParenExpr();
+  ExprAST *parseIdentifierExpr();
+  ExprAST *parseIfExpr();
+  ExprAST *parseForExpr();
+  ExprAST *parseVarExpr();
+  ExprAST *parsePrimary();
+  ExprAST *parseExpression();
+  ExprAST *parseUnary();
+  ExprAST *parseBinOpRHS(int prec, ExprAST *lhs);
   std::unique_ptr<PrototypeAST> parsePrototype();
   std::unique_ptr<FunctionAST> parseDefinition();
   std::unique_ptr<FunctionAST> parseTopLevelExpr();
@@ -41,13 +52,36 @@ public:
 
 static llvm::ExitOnError ExitOnErr;
 
+/// @brief A definition compiled on the thread pool: what the REPL would have
+/// printed for it and the bitcode of its module, empty if it failed.
+struct CompiledDefinition {
+  std::string output;
+  llvm::SmallVector<char, 0> bitcode;
+};
+
 class Driver {
   std::ostream &out_;
   Parser &parser_;
   std::unique_ptr<llvm::orc::KaleidoscopeJIT> jit_;
+  PrototypeTable protos_;
+  // Generates the externs and top-level expressions, and the definitions
+  // unless they go to pool_.
+  CodegenContext codegen_;
+  // Set when compiling to an object file with more than one thread. Every
+  // definition is then generated and optimized in its own CodegenContext on
+  // the pool and linked into codegen_'s module at the end of the input.
+  std::unique_ptr<llvm::DefaultThreadPool> pool_;
+  // A deque, so the tasks' references stay valid as definitions are added.
+  std::deque<CompiledDefinition> definitions_;
+  llvm::DenseSet<Symbol> defined_;
+
+  void compileDefinitionAsync(std::unique_ptr<FunctionAST> ast);
+  void finishDefinitions();
 
 public:
-  Driver(std::ostream &out, Parser &parser, bool useJIT = true);
+  Driver(std::ostream &out, Parser &parser, bool useJIT = true,
+         unsigned threads = 1, bool lazy = false);
+  llvm::Module &getModule() { return *codegen_.irModule; }
   void handleDefinition();
   void handleExtern();
   void handleTopLevelExpression();
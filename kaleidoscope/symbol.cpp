@@ -0,0 +1,24 @@
+#include "symbol.h"
+#include <string>
+
+SymbolTable TheSymbols;
+
+Symbol SymbolTable::internLocked(llvm::StringRef name) {
+  auto it = ids_.try_emplace(name, ids_.size() + 1).first;
+  return Symbol(&*it);
+}
+
+Symbol SymbolTable::intern(llvm::StringRef name) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return internLocked(name);
+}
+
+Symbol SymbolTable::getOperator(std::array<Symbol, 256> &symbols,
+                                llvm::StringRef prefix, char op) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto &symbol = symbols[static_cast<unsigned char>(op)];
+  if (symbol == Symbol()) {
+    symbol = internLocked(prefix.str() + op);
+  }
+  return symbol;
+}
\ No newline at end of file
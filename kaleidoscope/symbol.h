@@ -0,0 +1,73 @@
+#ifndef SYMBOL_H
+#define SYMBOL_H
+
+#include "llvm/ADT/DenseMapInfo.h"
+#include "llvm/ADT/StringMap.h"
+#include <array>
+#include <mutex>
+
+/// @brief An interned name. Equal names are the same symbol, so symbols are
+/// compared and hashed as pointers instead of strings. A symbol points to its
+/// entry in the symbol table, so reading its name or ID takes no lock. The
+/// default symbol is the empty name.
+class Symbol {
+  const llvm::StringMapEntry<unsigned> *entry_;
+
+public:
+  Symbol() : entry_(nullptr) {}
+  explicit Symbol(const llvm::StringMapEntry<unsigned> *entry)
+      : entry_(entry) {}
+  unsigned getID() const { return entry_ ? entry_->getValue() : 0; }
+  llvm::StringRef getName() const { return entry_ ? entry_->getKey() : ""; }
+  const void *getOpaqueValue() const { return entry_; }
+  bool operator==(Symbol other) const { return entry_ == other.entry_; }
+  bool operator!=(Symbol other) const { return entry_ != other.entry_; }
+};
+
+/// @brief Interns names into symbols whose IDs count up from 1 in the order
+/// the names are first seen. Names live as long as the table. Interning is
+/// thread-safe, so code generation on other threads can run while the parser
+/// interns new names.
+class SymbolTable {
+  std::mutex mutex_;
+  // Entries don't move when the map grows, so symbols can point to them.
+  llvm::StringMap<unsigned> ids_;
+  // Symbols of the functions implementing user defined operators, or the
+  // empty name if not interned yet.
+  std::array<Symbol, 256> unaryOperators_;
+  std::array<Symbol, 256> binaryOperators_;
+
+  Symbol internLocked(llvm::StringRef name);
+  Symbol getOperator(std::array<Symbol, 256> &symbols, llvm::StringRef prefix,
+                     char op);
+
+public:
+  Symbol intern(llvm::StringRef name);
+  /// @brief Returns the symbol of "unary" followed by op.
+  Symbol getUnaryOperator(char op) {
+    return getOperator(unaryOperators_, "unary", op);
+  }
+  /// @brief Returns the symbol of "binary" followed by op.
+  Symbol getBinaryOperator(char op) {
+    return getOperator(binaryOperators_, "binary", op);
+  }
+};
+
+extern SymbolTable TheSymbols;
+
+template <> struct llvm::DenseMapInfo<Symbol> {
+  static Symbol getEmptyKey() {
+    return Symbol(static_cast<const llvm::StringMapEntry<unsigned> *>(
+        DenseMapInfo<const void *>::getEmptyKey()));
+  }
+  static Symbol getTombstoneKey() {
+    return Symbol(static_cast<const llvm::StringMapEntry<unsigned> *>(
+        DenseMapInfo<const void *>::getTombstoneKey()));
+  }
+  static unsigned getHashValue(Symbol symbol) {
+    return DenseMapInfo<const void *>::getHashValue(symbol.getOpaqueValue());
+  }
+  static bool isEqual(Symbol lhs, Symbol rhs) { return lhs == rhs; }
+};
+
+#endif
\ No newline at end of file
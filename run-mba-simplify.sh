@@ -0,0 +1 @@
+opt-19 -load-pass-plugin ./libMBAAdd.so -load-pass-plugin ./libMBASimplify.so -passes=mba-add,mba-simplify -stats -S inputs/input_for_mba_add.ll -o out.ll
\ No newline at end of file
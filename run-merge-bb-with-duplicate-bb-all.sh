@@ -0,0 +1 @@
+opt-19 -load-pass-plugin ./libLLVMPassesAll.so -passes=duplicate-bb,merge-bb -S inputs/input_for_duplicate_bb.ll -o out.ll
\ No newline at end of file
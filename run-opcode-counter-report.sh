@@ -0,0 +1 @@
+opt-19 -load-pass-plugin ./libOpcodeCounter.so -passes=opcode-counter-report -disable-output inputs/input_for_cc.bc
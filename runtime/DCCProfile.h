@@ -0,0 +1,45 @@
+#ifndef DCC_PROFILE_H
+#define DCC_PROFILE_H
+
+#include <cstdint>
+
+/*
+ * Binary profile written by the DynamicCallCounter runtime, in host byte
+ * order:
+ *
+ *   ProfileHeader
+ *   NameEntry[numFunctions]
+ *   name bytes
+ *   padding up to a 64 byte boundary
+ *   uint64_t counters[numFunctions]   (at countersOffset)
+ *
+ * The file is memory mapped by the instrumented program and its counters are
+ * updated in place, so it can be read while the program is running. The
+ * generation is incremented after every update.
+ */
+namespace dcc {
+
+constexpr char ProfileMagic[8] = {'D', 'C', 'C', 'P', 'R', 'O', 'F', '\0'};
+constexpr uint32_t ProfileVersion = 2;
+
+struct ProfileHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t numFunctions;
+  uint64_t namesOffset;
+  uint64_t countersOffset;
+  uint64_t generation;
+};
+
+struct NameEntry {
+  // Offset of the name from the start of the file.
+  uint64_t offset;
+  uint32_t size;
+  // Only 1 in samplePeriod calls were counted, the estimated number of calls
+  // is the counter multiplied by it.
+  uint32_t samplePeriod;
+};
+
+} // namespace dcc
+
+#endif
@@ -0,0 +1,204 @@
+#include "DCCProfile.h"
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <mutex>
+#include <string>
+#include <sys/mman.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+/*
+ * Runtime for modules instrumented with -dynamic-call-counter-binary.
+ *
+ * Every instrumented module registers its counter array from a global
+ * constructor. The runtime sums the shards of every registered module into a
+ * memory mapped profile (see DCCProfile.h) at exit and, if
+ * DCC_FLUSH_INTERVAL_MS is set, periodically from a background thread.
+ *
+ * Environment variables:
+ *   DCC_PROFILE_FILE       path of the profile (default: dcc.profdata)
+ *   DCC_FLUSH_INTERVAL_MS  flush period in milliseconds (default: 0, only at
+ *                          exit)
+ */
+
+namespace {
+
+struct Registration {
+  const char *const *names;
+  uint64_t *counters;
+  uint32_t numFunctions;
+  uint32_t numShards;
+  uint32_t shardStride;
+  uint32_t samplePeriod;
+};
+
+uint64_t alignTo(uint64_t value, uint64_t align) {
+  return (value + align - 1) / align * align;
+}
+
+class ProfileWriter {
+  std::mutex mutex_;
+  std::vector<Registration> modules_;
+  uint32_t numFunctions_ = 0;
+
+  int fd_ = -1;
+  char *map_ = nullptr;
+  size_t mapSize_ = 0;
+  // Set when a module registered after the file was laid out.
+  bool layoutChanged_ = true;
+
+  std::thread flusher_;
+  std::condition_variable stopFlusher_;
+  bool stopping_ = false;
+
+  dcc::ProfileHeader *header() {
+    return reinterpret_cast<dcc::ProfileHeader *>(map_);
+  }
+
+  void unmap() {
+    if (map_) {
+      msync(map_, mapSize_, MS_SYNC);
+      munmap(map_, mapSize_);
+      map_ = nullptr;
+    }
+    if (fd_ >= 0) {
+      close(fd_);
+      fd_ = -1;
+    }
+  }
+
+  /**
+   * Creates the profile file for the registered modules and writes the
+   * header and name table. The counters are written by flushLocked().
+   */
+  bool layout() {
+    unmap();
+
+    uint64_t namesOffset = sizeof(dcc::ProfileHeader);
+    uint64_t stringsOffset =
+        namesOffset + numFunctions_ * sizeof(dcc::NameEntry);
+    uint64_t stringsSize = 0;
+    for (auto &module : modules_) {
+      for (uint32_t i = 0; i < module.numFunctions; ++i) {
+        stringsSize += strlen(module.names[i]);
+      }
+    }
+    uint64_t countersOffset = alignTo(stringsOffset + stringsSize, 64);
+    mapSize_ = countersOffset + numFunctions_ * sizeof(uint64_t);
+
+    const char *path = getenv("DCC_PROFILE_FILE");
+    path = path && *path ? path : "dcc.profdata";
+    fd_ = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd_ < 0 || ftruncate(fd_, mapSize_) != 0) {
+      perror("dcc: could not create profile");
+      unmap();
+      return false;
+    }
+    void *map =
+        mmap(nullptr, mapSize_, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+    if (map == MAP_FAILED) {
+      perror("dcc: could not map profile");
+      unmap();
+      return false;
+    }
+    map_ = static_cast<char *>(map);
+
+    auto entries = reinterpret_cast<dcc::NameEntry *>(map_ + namesOffset);
+    uint64_t stringOffset = stringsOffset;
+    for (auto &module : modules_) {
+      for (uint32_t i = 0; i < module.numFunctions; ++i) {
+        uint32_t size = strlen(module.names[i]);
+        memcpy(map_ + stringOffset, module.names[i], size);
+        *entries++ = {stringOffset, size, module.samplePeriod};
+        stringOffset += size;
+      }
+    }
+
+    auto hdr = header();
+    memcpy(hdr->magic, dcc::ProfileMagic, sizeof(hdr->magic));
+    hdr->version = dcc::ProfileVersion;
+    hdr->numFunctions = numFunctions_;
+    hdr->namesOffset = namesOffset;
+    hdr->countersOffset = countersOffset;
+    hdr->generation = 0;
+    layoutChanged_ = false;
+    return true;
+  }
+
+  void runFlusher(std::chrono::milliseconds interval) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (!stopFlusher_.wait_for(lock, interval, [&] { return stopping_; })) {
+      flushLocked();
+    }
+  }
+
+  void flushLocked() {
+    if (modules_.empty() || (layoutChanged_ && !layout())) {
+      return;
+    }
+
+    auto out = reinterpret_cast<uint64_t *>(map_ + header()->countersOffset);
+    for (auto &module : modules_) {
+      for (uint32_t i = 0; i < module.numFunctions; ++i) {
+        uint64_t sum = 0;
+        for (uint32_t shard = 0; shard < module.numShards; ++shard) {
+          sum += std::atomic_ref<uint64_t>(
+                     module.counters[shard * module.shardStride + i])
+                     .load(std::memory_order_relaxed);
+        }
+        std::atomic_ref<uint64_t>(*out++).store(sum,
+                                                std::memory_order_relaxed);
+      }
+    }
+    std::atomic_ref<uint64_t>(header()->generation)
+        .fetch_add(1, std::memory_order_release);
+  }
+
+public:
+  ~ProfileWriter() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stopping_ = true;
+    }
+    stopFlusher_.notify_all();
+    if (flusher_.joinable()) {
+      flusher_.join();
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    flushLocked();
+    unmap();
+  }
+
+  void add(const Registration &registration) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    modules_.push_back(registration);
+    numFunctions_ += registration.numFunctions;
+    layoutChanged_ = true;
+
+    const char *interval = getenv("DCC_FLUSH_INTERVAL_MS");
+    if (!flusher_.joinable() && interval && atol(interval) > 0) {
+      flusher_ = std::thread(&ProfileWriter::runFlusher, this,
+                             std::chrono::milliseconds(atol(interval)));
+    }
+  }
+};
+
+ProfileWriter &getWriter() {
+  static ProfileWriter writer;
+  return writer;
+}
+
+} // namespace
+
+extern "C" void __dcc_register(const char *const *names, uint64_t *counters,
+                               uint32_t numFunctions, uint32_t numShards,
+                               uint32_t shardStride, uint32_t samplePeriod) {
+  getWriter().add(
+      {names, counters, numFunctions, numShards, shardStride, samplePeriod});
+}
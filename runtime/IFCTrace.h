@@ -0,0 +1,48 @@
+#ifndef IFC_TRACE_H
+#define IFC_TRACE_H
+
+#include <cstdint>
+
+/*
+ * Binary trace written by the InjectFuncCall runtime, in host byte order:
+ *
+ *   TraceHeader
+ *   TraceEvent[numEvents]
+ *   NameEntry[numFunctions]   (at namesOffset)
+ *   name bytes
+ *
+ * Events are appended while the program runs, the header and the function
+ * names are written when the program exits.
+ */
+namespace ifc {
+
+constexpr char TraceMagic[8] = {'I', 'F', 'C', 'T', 'R', 'A', 'C', 'E'};
+constexpr uint32_t TraceVersion = 1;
+
+struct TraceHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t numFunctions;
+  uint64_t numEvents;
+  // Events lost because a thread's ring buffer was full.
+  uint64_t droppedEvents;
+  uint64_t namesOffset;
+  // Converts event timestamps to microseconds.
+  double ticksPerMicrosecond;
+};
+
+struct TraceEvent {
+  uint64_t timestamp;
+  uint32_t functionId;
+  uint32_t threadId;
+};
+
+struct NameEntry {
+  // Offset of the name from the start of the file.
+  uint64_t offset;
+  uint64_t size;
+};
+
+} // namespace ifc
+
+#endif
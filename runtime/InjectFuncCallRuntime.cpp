@@ -0,0 +1,231 @@
+#include "IFCTrace.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+/*
+ * Runtime for modules instrumented with -inject-func-call-trace.
+ *
+ * Every instrumented function entry appends a TraceEvent to a ring buffer
+ * owned by the calling thread. The buffers are single producer, single
+ * consumer queues, so recording an event takes no lock. A background thread
+ * drains the buffers into the trace file (see IFCTrace.h), which is finished
+ * with the function names when the program exits.
+ *
+ * Environment variables:
+ *   IFC_TRACE_FILE         path of the trace (default: ifc.trace)
+ *   IFC_DRAIN_INTERVAL_MS  drain period in milliseconds (default: 10)
+ */
+
+namespace {
+
+uint64_t readTimestamp() {
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+#else
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+#endif
+}
+
+constexpr uint64_t RingSize = 1 << 14;
+
+struct alignas(64) ThreadBuffer {
+  // Written by the owning thread only.
+  std::atomic<uint64_t> head{0};
+  std::atomic<uint64_t> dropped{0};
+  // Written by the drain thread only.
+  alignas(64) std::atomic<uint64_t> tail{0};
+  ifc::TraceEvent events[RingSize];
+};
+
+// Set once the trace file is finished. Constant initialized, so it is valid
+// for the whole life of the process, and events recorded after it is set are
+// discarded.
+std::atomic<bool> traceFinished{false};
+
+class TraceWriter {
+  std::mutex mutex_;
+  // Buffers are never freed: a thread that exits still has its last events
+  // drained, and a thread that outlives the trace keeps a valid buffer.
+  std::vector<std::unique_ptr<ThreadBuffer>> buffers_;
+  std::vector<const char *> names_;
+
+  FILE *file_ = nullptr;
+  uint64_t numEvents_ = 0;
+  uint64_t startTicks_;
+  std::chrono::steady_clock::time_point startTime_;
+
+  std::thread drainer_;
+  std::condition_variable stopDrainer_;
+  bool stopping_ = false;
+
+  std::vector<ifc::TraceEvent> scratch_;
+
+  void drainLocked() {
+    for (auto &buffer : buffers_) {
+      uint64_t tail = buffer->tail.load(std::memory_order_relaxed);
+      uint64_t head = buffer->head.load(std::memory_order_acquire);
+      scratch_.clear();
+      for (; tail != head; ++tail) {
+        scratch_.push_back(buffer->events[tail & (RingSize - 1)]);
+      }
+      buffer->tail.store(tail, std::memory_order_release);
+      if (file_ && !scratch_.empty()) {
+        fwrite(scratch_.data(), sizeof(ifc::TraceEvent), scratch_.size(),
+               file_);
+        numEvents_ += scratch_.size();
+      }
+    }
+  }
+
+  void runDrainer(std::chrono::milliseconds interval) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (!stopDrainer_.wait_for(lock, interval, [&] { return stopping_; })) {
+      drainLocked();
+    }
+  }
+
+  void finish() {
+    if (!file_) {
+      return;
+    }
+    ifc::TraceHeader header;
+    memcpy(header.magic, ifc::TraceMagic, sizeof(header.magic));
+    header.version = ifc::TraceVersion;
+    header.numFunctions = names_.size();
+    header.numEvents = numEvents_;
+    header.droppedEvents = 0;
+    for (auto &buffer : buffers_) {
+      header.droppedEvents += buffer->dropped.load(std::memory_order_relaxed);
+    }
+    header.namesOffset =
+        sizeof(header) + numEvents_ * sizeof(ifc::TraceEvent);
+
+    auto elapsed = std::chrono::duration<double, std::micro>(
+                       std::chrono::steady_clock::now() - startTime_)
+                       .count();
+    header.ticksPerMicrosecond =
+        elapsed > 0 ? (readTimestamp() - startTicks_) / elapsed : 1;
+
+    uint64_t stringOffset =
+        header.namesOffset + names_.size() * sizeof(ifc::NameEntry);
+    for (auto name : names_) {
+      ifc::NameEntry entry{stringOffset, strlen(name)};
+      fwrite(&entry, sizeof(entry), 1, file_);
+      stringOffset += entry.size;
+    }
+    for (auto name : names_) {
+      fwrite(name, 1, strlen(name), file_);
+    }
+    fseek(file_, 0, SEEK_SET);
+    fwrite(&header, sizeof(header), 1, file_);
+    fclose(file_);
+    file_ = nullptr;
+  }
+
+public:
+  TraceWriter()
+      : startTicks_(readTimestamp()),
+        startTime_(std::chrono::steady_clock::now()) {
+    const char *path = getenv("IFC_TRACE_FILE");
+    path = path && *path ? path : "ifc.trace";
+    file_ = fopen(path, "wb");
+    if (!file_) {
+      perror("ifc: could not create trace");
+      return;
+    }
+    // Reserve room for the header, it is written once the trace is finished.
+    ifc::TraceHeader header{};
+    fwrite(&header, sizeof(header), 1, file_);
+
+    const char *interval = getenv("IFC_DRAIN_INTERVAL_MS");
+    long intervalMs = interval ? atol(interval) : 10;
+    drainer_ = std::thread(&TraceWriter::runDrainer, this,
+                           std::chrono::milliseconds(std::max(intervalMs, 1L)));
+  }
+
+  // Called from atexit. The writer itself is never destroyed, so threads
+  // still running and instrumented code in later static destructors only see
+  // the finished flag.
+  void shutdown() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stopping_ = true;
+    }
+    stopDrainer_.notify_all();
+    if (drainer_.joinable()) {
+      drainer_.join();
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    traceFinished.store(true, std::memory_order_relaxed);
+    drainLocked();
+    finish();
+  }
+
+  uint32_t addFunctions(const char *const *names, uint32_t numFunctions) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    uint32_t base = names_.size();
+    names_.insert(names_.end(), names, names + numFunctions);
+    return base;
+  }
+
+  ThreadBuffer *addThread(uint32_t &threadId) {
+    auto buffer = std::make_unique<ThreadBuffer>();
+    std::lock_guard<std::mutex> lock(mutex_);
+    threadId = buffers_.size();
+    buffers_.push_back(std::move(buffer));
+    return buffers_.back().get();
+  }
+};
+
+TraceWriter &getWriter() {
+  // Deliberately leaked, see shutdown().
+  static TraceWriter *writer = [] {
+    auto created = new TraceWriter;
+    atexit([] { getWriter().shutdown(); });
+    return created;
+  }();
+  return *writer;
+}
+
+thread_local ThreadBuffer *threadBuffer = nullptr;
+thread_local uint32_t threadId = 0;
+
+} // namespace
+
+extern "C" uint32_t __ifc_register(const char *const *names,
+                                   uint32_t numFunctions) {
+  return getWriter().addFunctions(names, numFunctions);
+}
+
+extern "C" void __ifc_trace_enter(uint32_t functionId) {
+  if (traceFinished.load(std::memory_order_relaxed)) {
+    return;
+  }
+  uint64_t timestamp = readTimestamp();
+  auto buffer = threadBuffer;
+  if (!buffer) {
+    buffer = threadBuffer = getWriter().addThread(threadId);
+  }
+  uint64_t head = buffer->head.load(std::memory_order_relaxed);
+  if (head - buffer->tail.load(std::memory_order_acquire) == RingSize) {
+    buffer->dropped.fetch_add(1, std::memory_order_relaxed);
+    return;
+  }
+  buffer->events[head & (RingSize - 1)] = {timestamp, functionId, threadId};
+  buffer->head.store(head + 1, std::memory_order_release);
+}
@@ -0,0 +1,109 @@
+#include "DCCProfile.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/JSON.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/raw_ostream.h"
+#include <algorithm>
+#include <cstring>
+
+/*
+ * Prints a profile written by the DynamicCallCounter runtime as text or JSON.
+ * The profile may still be updated by a running program. Sampled counters are
+ * scaled back up by their sample period.
+ */
+
+using namespace llvm;
+
+static cl::opt<std::string> InputFilename(cl::Positional,
+                                          cl::desc("<profile>"),
+                                          cl::init("dcc.profdata"));
+static cl::opt<bool> JSON("json", cl::desc("Print the profile as JSON"),
+                          cl::init(false));
+
+int main(int argc, char **argv) {
+  cl::ParseCommandLineOptions(argc, argv,
+                              "DynamicCallCounter profile reader\n");
+
+  // The file may be written concurrently, so read a copy instead of mapping it.
+  auto bufferOrErr = MemoryBuffer::getFile(InputFilename, /*IsText=*/false,
+                                           /*RequiresNullTerminator=*/false,
+                                           /*IsVolatile=*/true);
+  if (!bufferOrErr) {
+    errs() << "Could not open " << InputFilename << ": "
+           << bufferOrErr.getError().message() << "\n";
+    return 1;
+  }
+  StringRef data = (*bufferOrErr)->getBuffer();
+
+  dcc::ProfileHeader header;
+  if (data.size() < sizeof(header)) {
+    errs() << InputFilename << ": truncated profile header\n";
+    return 1;
+  }
+  memcpy(&header, data.data(), sizeof(header));
+  if (memcmp(header.magic, dcc::ProfileMagic, sizeof(header.magic)) != 0 ||
+      header.version != dcc::ProfileVersion) {
+    errs() << InputFilename << ": not a version " << dcc::ProfileVersion
+           << " DynamicCallCounter profile\n";
+    return 1;
+  }
+  uint64_t namesEnd =
+      header.namesOffset + header.numFunctions * sizeof(dcc::NameEntry);
+  uint64_t countersEnd =
+      header.countersOffset + header.numFunctions * sizeof(uint64_t);
+  if (namesEnd > data.size() || countersEnd > data.size()) {
+    errs() << InputFilename << ": truncated profile\n";
+    return 1;
+  }
+
+  struct FunctionCount {
+    StringRef name;
+    uint64_t count;
+    uint32_t samplePeriod;
+  };
+  std::vector<FunctionCount> functions;
+  for (uint32_t i = 0; i < header.numFunctions; ++i) {
+    dcc::NameEntry entry;
+    memcpy(&entry, data.data() + header.namesOffset + i * sizeof(entry),
+           sizeof(entry));
+    uint64_t count;
+    memcpy(&count, data.data() + header.countersOffset + i * sizeof(count),
+           sizeof(count));
+    if (entry.offset + entry.size > data.size()) {
+      errs() << InputFilename << ": function name out of bounds\n";
+      return 1;
+    }
+    functions.push_back({data.substr(entry.offset, entry.size), count,
+                         std::max(entry.samplePeriod, 1U)});
+  }
+
+  if (JSON) {
+    json::OStream J(outs(), 2);
+    J.object([&] {
+      J.attribute("generation", static_cast<int64_t>(header.generation));
+      J.attributeArray("functions", [&] {
+        for (auto &function : functions) {
+          J.object([&] {
+            J.attribute("name", function.name);
+            J.attribute("count", static_cast<int64_t>(function.count *
+                                                      function.samplePeriod));
+            J.attribute("sampled", static_cast<int64_t>(function.count));
+            J.attribute("samplePeriod", function.samplePeriod);
+          });
+        }
+      });
+    });
+    outs() << "\n";
+  } else {
+    for (auto &function : functions) {
+      outs() << function.name << " -> "
+             << function.count * function.samplePeriod;
+      if (function.samplePeriod > 1) {
+        outs() << " (" << function.count << " sampled 1 in "
+               << function.samplePeriod << ")";
+      }
+      outs() << "\n";
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,117 @@
+#include "IFCTrace.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/JSON.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/raw_ostream.h"
+#include <cstring>
+
+/*
+ * Converts a trace written by the InjectFuncCall runtime into the Chrome
+ * trace event format, which can be loaded by chrome://tracing or Perfetto.
+ * Every function entry becomes an instant event on its thread's track.
+ */
+
+using namespace llvm;
+
+static cl::opt<std::string> InputFilename(cl::Positional,
+                                          cl::desc("<trace>"),
+                                          cl::init("ifc.trace"));
+static cl::opt<std::string> OutputFilename("o",
+                                           cl::desc("Output JSON file"),
+                                           cl::value_desc("filename"),
+                                           cl::init("-"));
+
+int main(int argc, char **argv) {
+  cl::ParseCommandLineOptions(argc, argv, "InjectFuncCall trace converter\n");
+
+  auto bufferOrErr = MemoryBuffer::getFile(InputFilename, /*IsText=*/false,
+                                           /*RequiresNullTerminator=*/false);
+  if (!bufferOrErr) {
+    errs() << "Could not open " << InputFilename << ": "
+           << bufferOrErr.getError().message() << "\n";
+    return 1;
+  }
+  StringRef data = (*bufferOrErr)->getBuffer();
+
+  ifc::TraceHeader header;
+  if (data.size() < sizeof(header)) {
+    errs() << InputFilename << ": truncated trace header\n";
+    return 1;
+  }
+  memcpy(&header, data.data(), sizeof(header));
+  if (memcmp(header.magic, ifc::TraceMagic, sizeof(header.magic)) != 0 ||
+      header.version != ifc::TraceVersion) {
+    errs() << InputFilename << ": not a version " << ifc::TraceVersion
+           << " InjectFuncCall trace\n";
+    return 1;
+  }
+  uint64_t eventsEnd =
+      sizeof(header) + header.numEvents * sizeof(ifc::TraceEvent);
+  uint64_t namesEnd =
+      header.namesOffset + header.numFunctions * sizeof(ifc::NameEntry);
+  if (eventsEnd > header.namesOffset || namesEnd > data.size()) {
+    errs() << InputFilename << ": truncated trace\n";
+    return 1;
+  }
+
+  std::vector<StringRef> names;
+  for (uint32_t i = 0; i < header.numFunctions; ++i) {
+    ifc::NameEntry entry;
+    memcpy(&entry, data.data() + header.namesOffset + i * sizeof(entry),
+           sizeof(entry));
+    if (entry.offset + entry.size > data.size()) {
+      errs() << InputFilename << ": function name out of bounds\n";
+      return 1;
+    }
+    names.push_back(data.substr(entry.offset, entry.size));
+  }
+
+  std::error_code EC;
+  raw_fd_ostream out(OutputFilename, EC, sys::fs::OF_Text);
+  if (EC) {
+    errs() << "Could not open " << OutputFilename << ": " << EC.message()
+           << "\n";
+    return 1;
+  }
+
+  // Timestamps are shown relative to the earliest event, which is not
+  // necessarily the first one in the file since threads are drained in turn.
+  uint64_t startTicks = UINT64_MAX;
+  for (uint64_t i = 0; i < header.numEvents; ++i) {
+    ifc::TraceEvent event;
+    memcpy(&event, data.data() + sizeof(header) + i * sizeof(event),
+           sizeof(event));
+    startTicks = std::min(startTicks, event.timestamp);
+  }
+  double ticksPerMicrosecond =
+      header.ticksPerMicrosecond > 0 ? header.ticksPerMicrosecond : 1;
+
+  json::OStream J(out);
+  J.object([&] {
+    J.attributeArray("traceEvents", [&] {
+      for (uint64_t i = 0; i < header.numEvents; ++i) {
+        ifc::TraceEvent event;
+        memcpy(&event, data.data() + sizeof(header) + i * sizeof(event),
+               sizeof(event));
+        J.object([&] {
+          J.attribute("name", event.functionId < names.size()
+                                  ? names[event.functionId]
+                                  : StringRef("<unknown>"));
+          J.attribute("ph", "i");
+          J.attribute("s", "t");
+          J.attribute("ts",
+                      (event.timestamp - startTicks) / ticksPerMicrosecond);
+          J.attribute("pid", 1);
+          J.attribute("tid", event.threadId);
+        });
+      }
+    });
+    J.attribute("displayTimeUnit", "ns");
+    J.attributeObject("otherData", [&] {
+      J.attribute("droppedEvents", static_cast<int64_t>(header.droppedEvents));
+    });
+  });
+  out << "\n";
+  return 0;
+}
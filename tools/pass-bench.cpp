@@ -0,0 +1,423 @@
+#include "LLVMPasses.h"
+#include "RIV.h"
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IR/Verifier.h"
+#include "llvm/Passes/PassBuilder.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/JSON.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/raw_ostream.h"
+#include <chrono>
+#include <cstdlib>
+#include <fcntl.h>
+#include <unistd.h>
+
+/*
+ * Benchmarks the passes on synthetic modules whose size grows along one
+ * dimension at a time: the number of functions, the blocks per function, the
+ * predecessors of every join block and the integer instructions per block.
+ * Every pass runs in-process on a freshly generated module, and its time, peak
+ * memory and IR growth are reported as text or JSON.
+ */
+
+using namespace llvm;
+
+static cl::opt<unsigned> NumFunctions("functions",
+                                      cl::desc("Base number of functions"),
+                                      cl::init(16));
+static cl::opt<unsigned>
+    NumBlocks("blocks", cl::desc("Base number of blocks per function"),
+              cl::init(64));
+static cl::opt<unsigned>
+    FanIn("fan-in", cl::desc("Base number of predecessors of join blocks"),
+          cl::init(4));
+static cl::opt<unsigned>
+    IntDensity("int-density",
+               cl::desc("Base number of integer instructions per block"),
+               cl::init(4));
+static cl::opt<unsigned>
+    ScaleSteps("scale-steps",
+               cl::desc("Number of times every dimension is doubled"),
+               cl::init(4));
+static cl::list<std::string>
+    Passes("passes", cl::desc("Pipelines to benchmark (default: all)"),
+           cl::CommaSeparated);
+static cl::opt<bool> JSON("json", cl::desc("Print the results as JSON"),
+                          cl::init(false));
+static cl::opt<bool>
+    Cache("cache",
+          cl::desc("Also time every pipeline on a second, identical module "
+                   "whose analyses load their results from a temporary "
+                   "LLVM_PASSES_CACHE_DIR filled by the first run"),
+          cl::init(false));
+static cl::opt<std::string> OutputFilename("o", cl::desc("Output file"),
+                                           cl::value_desc("filename"),
+                                           cl::init("-"));
+
+namespace {
+
+struct ModuleShape {
+  unsigned functions, blocks, fanIn, intDensity;
+};
+
+/**
+ * Generates a function made of groups of blocks. Each group switches to one
+ * of fanIn case blocks that compute intDensity integer instructions and join
+ * in a block with a PHI, so every join block has fanIn predecessors. The
+ * instructions of a case block only read values defined before the switch,
+ * and the last one is passed to the PHI, so case blocks of the same parity
+ * have identical operands, which is what merge-bb looks for.
+ */
+void generateFunction(Module &M, const ModuleShape &shape, unsigned index,
+                      Function *callee) {
+  LLVMContext &CTX = M.getContext();
+  IRBuilder<> builder(CTX);
+  auto I32Ty = builder.getInt32Ty();
+  auto FnTy = FunctionType::get(
+      I32Ty, {I32Ty, I32Ty, builder.getDoubleTy()}, false);
+  auto F = Function::Create(FnTy, GlobalValue::ExternalLinkage,
+                            "f" + Twine(index), M);
+  Value *a = F->getArg(0), *b = F->getArg(1), *d = F->getArg(2);
+
+  builder.SetInsertPoint(BasicBlock::Create(CTX, "entry", F));
+  Value *current = a;
+  if (callee) {
+    current = builder.CreateCall(callee, {a, b, d});
+  }
+
+  unsigned fanIn = std::max(shape.fanIn, 1U);
+  unsigned numGroups = std::max(shape.blocks / (fanIn + 1), 1U);
+  for (unsigned group = 0; group < numGroups; ++group) {
+    auto join = BasicBlock::Create(CTX, "join", F);
+    auto selector = builder.CreateURem(
+        builder.CreateAdd(current, builder.getInt32(group)),
+        builder.getInt32(fanIn));
+    auto switchInst = builder.CreateSwitch(selector, join, fanIn);
+
+    builder.SetInsertPoint(join);
+    auto phi = builder.CreatePHI(I32Ty, fanIn + 1);
+    phi->addIncoming(current, switchInst->getParent());
+    for (unsigned k = 0; k < fanIn; ++k) {
+      auto caseBlock = BasicBlock::Create(CTX, "case", F, join);
+      switchInst->addCase(builder.getInt32(k), caseBlock);
+      builder.SetInsertPoint(caseBlock);
+      Value *value = current;
+      for (unsigned i = 0; i < shape.intDensity; ++i) {
+        auto constant = builder.getInt32(k % 2 + i + 1);
+        switch (i % 3) {
+        case 0:
+          value = builder.CreateAdd(current, constant);
+          break;
+        case 1:
+          value = builder.CreateSub(current, b);
+          break;
+        default:
+          value = builder.CreateMul(current, constant);
+          break;
+        }
+      }
+      builder.CreateBr(join);
+      phi->addIncoming(value, caseBlock);
+    }
+
+    builder.SetInsertPoint(join);
+    auto isOne = builder.CreateFCmpOEQ(d, ConstantFP::get(d->getType(), 1.0));
+    current = builder.CreateAdd(phi, builder.CreateZExt(isOne, I32Ty));
+  }
+  builder.CreateRet(current);
+}
+
+std::unique_ptr<Module> generateModule(LLVMContext &CTX,
+                                       const ModuleShape &shape) {
+  auto M = std::make_unique<Module>("bench", CTX);
+  Function *callee = nullptr;
+  for (unsigned i = 0; i < shape.functions; ++i) {
+    generateFunction(*M, shape, i, callee);
+    callee = M->getFunction(("f" + Twine(i)).str());
+  }
+  return M;
+}
+
+uint64_t countInstructions(const Module &M) {
+  uint64_t count = 0;
+  for (auto &F : M) {
+    count += F.getInstructionCount();
+  }
+  return count;
+}
+
+/**
+ * Resets the peak resident set size of the process, if the kernel supports
+ * it, so getPeakRSSKB() reports the peak of the next measurement only.
+ */
+void resetPeakRSS() {
+  std::error_code EC;
+  raw_fd_ostream clearRefs("/proc/self/clear_refs", EC);
+  if (!EC) {
+    clearRefs << "5";
+  }
+}
+
+uint64_t getPeakRSSKB() {
+  auto status = MemoryBuffer::getFileAsStream("/proc/self/status");
+  if (!status) {
+    return 0;
+  }
+  for (StringRef line : split((*status)->getBuffer(), '\n')) {
+    uint64_t peak;
+    if (line.consume_front("VmHWM:") && !line.trim().getAsInteger(10, peak)) {
+      return peak;
+    }
+  }
+  return 0;
+}
+
+/**
+ * Sends stderr to /dev/null while it is alive. The printer passes write their
+ * results to stderr, which would flood the benchmark output.
+ */
+class SilenceStderr {
+  int saved_ = -1;
+
+public:
+  SilenceStderr() {
+    errs().flush();
+    int devNull = open("/dev/null", O_WRONLY);
+    if (devNull < 0) {
+      return;
+    }
+    saved_ = dup(STDERR_FILENO);
+    dup2(devNull, STDERR_FILENO);
+    close(devNull);
+  }
+  ~SilenceStderr() {
+    if (saved_ < 0) {
+      return;
+    }
+    errs().flush();
+    dup2(saved_, STDERR_FILENO);
+    close(saved_);
+  }
+};
+
+struct Measurement {
+  std::string pipeline;
+  StringRef dimension;
+  ModuleShape shape;
+  double seconds;
+  uint64_t peakRSSKB;
+  uint64_t instructionsBefore, instructionsAfter;
+  // Time of the run that hit the analysis cache, with --cache.
+  double cachedSeconds = 0;
+};
+
+// The temporary analysis cache of --cache.
+SmallString<128> CacheDirectory;
+
+/**
+ * Runs the pipeline on a freshly generated module. The riv and lazy-riv
+ * pipelines compute the analyses of every function instead of running the
+ * riv printer, which would spend its time printing. The other printers run
+ * as they are, with their output discarded.
+ */
+Expected<Measurement> runPipeline(StringRef pipeline, StringRef dimension,
+                                  const ModuleShape &shape) {
+  LLVMContext CTX;
+  auto M = generateModule(CTX, shape);
+
+  LoopAnalysisManager LAM;
+  FunctionAnalysisManager FAM;
+  CGSCCAnalysisManager CGAM;
+  ModuleAnalysisManager MAM;
+  PassBuilder PB;
+  registerAllPasses(PB);
+  PB.registerModuleAnalyses(MAM);
+  PB.registerCGSCCAnalyses(CGAM);
+  PB.registerFunctionAnalyses(FAM);
+  PB.registerLoopAnalyses(LAM);
+  PB.crossRegisterProxies(LAM, FAM, CGAM, MAM);
+
+  ModulePassManager MPM;
+  bool isRIV = pipeline == "riv" || pipeline == "lazy-riv";
+  if (!isRIV) {
+    if (auto err = PB.parsePassPipeline(MPM, pipeline)) {
+      return std::move(err);
+    }
+  }
+
+  Measurement result{pipeline.str(), dimension, shape, 0, 0,
+                     countInstructions(*M), 0};
+  resetPeakRSS();
+  auto start = std::chrono::steady_clock::now();
+  if (pipeline == "riv") {
+    for (auto &F : *M) {
+      FAM.getResult<RIV>(F);
+    }
+  } else if (pipeline == "lazy-riv") {
+    for (auto &F : *M) {
+      FAM.getResult<LazyRIV>(F);
+    }
+  } else {
+    SilenceStderr silence;
+    MPM.run(*M, MAM);
+  }
+  result.seconds = std::chrono::duration<double>(
+                       std::chrono::steady_clock::now() - start)
+                       .count();
+  result.peakRSSKB = getPeakRSSKB();
+  result.instructionsAfter = countInstructions(*M);
+  if (verifyModule(*M, &errs())) {
+    return createStringError(inconvertibleErrorCode(),
+                             "%s produced invalid IR",
+                             result.pipeline.c_str());
+  }
+  return result;
+}
+
+/**
+ * Measures the pipeline. With --cache, the cache starts out empty so the
+ * first run misses on every function, and the generator is deterministic, so
+ * the second run hits on every function.
+ */
+Expected<Measurement> measure(StringRef pipeline, StringRef dimension,
+                              const ModuleShape &shape) {
+  if (Cache) {
+    sys::fs::remove_directories(CacheDirectory);
+  }
+  auto result = runPipeline(pipeline, dimension, shape);
+  if (!result || !Cache) {
+    return result;
+  }
+  auto cached = runPipeline(pipeline, dimension, shape);
+  if (!cached) {
+    return cached.takeError();
+  }
+  result->cachedSeconds = cached->seconds;
+  return result;
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+  cl::ParseCommandLineOptions(argc, argv, "Pass benchmark\n");
+  if (Cache) {
+    // The analyses read the directory once, so it is set before any runs.
+    if (auto EC = sys::fs::createUniqueDirectory("pass-bench-cache",
+                                                 CacheDirectory)) {
+      errs() << "Could not create the cache directory: " << EC.message()
+             << "\n";
+      return 1;
+    }
+    setenv("LLVM_PASSES_CACHE_DIR", CacheDirectory.c_str(), 1);
+  }
+
+  std::vector<std::string> pipelines(Passes.begin(), Passes.end());
+  if (pipelines.empty()) {
+    pipelines = {"riv",
+                 "lazy-riv",
+                 "duplicate-bb",
+                 "merge-bb",
+                 "mba-add",
+                 "mba-sub",
+                 "mba-simplify",
+                 "convert-fcmp-eq",
+                 "injectfunccall",
+                 "dynamic-call-counter",
+                 "opcode-counter",
+                 "static-call-counter",
+                 "find-fcmp-eq",
+                 "hello-world"};
+  }
+
+  // Every dimension is doubled ScaleSteps times while the others keep their
+  // base values.
+  ModuleShape base{NumFunctions, NumBlocks, FanIn, IntDensity};
+  std::vector<std::pair<StringRef, unsigned ModuleShape::*>> dimensions = {
+      {"functions", &ModuleShape::functions},
+      {"blocks", &ModuleShape::blocks},
+      {"fan-in", &ModuleShape::fanIn},
+      {"int-density", &ModuleShape::intDensity}};
+
+  std::vector<Measurement> measurements;
+  for (auto &pipeline : pipelines) {
+    for (auto [dimension, member] : dimensions) {
+      ModuleShape shape = base;
+      for (unsigned step = 0; step <= ScaleSteps; ++step) {
+        auto measurement = measure(pipeline, dimension, shape);
+        if (!measurement) {
+          errs() << pipeline << ": " << toString(measurement.takeError())
+                 << "\n";
+          return 1;
+        }
+        measurements.push_back(*measurement);
+        shape.*member *= 2;
+      }
+    }
+  }
+  if (Cache) {
+    sys::fs::remove_directories(CacheDirectory);
+  }
+
+  std::error_code EC;
+  raw_fd_ostream out(OutputFilename, EC, sys::fs::OF_Text);
+  if (EC) {
+    errs() << "Could not open " << OutputFilename << ": " << EC.message()
+           << "\n";
+    return 1;
+  }
+
+  if (JSON) {
+    json::OStream J(out, 2);
+    J.object([&] {
+      J.attributeObject("base", [&] {
+        J.attribute("functions", base.functions);
+        J.attribute("blocks", base.blocks);
+        J.attribute("fanIn", base.fanIn);
+        J.attribute("intDensity", base.intDensity);
+      });
+      J.attributeArray("results", [&] {
+        for (auto &m : measurements) {
+          J.object([&] {
+            J.attribute("pipeline", m.pipeline);
+            J.attribute("dimension", m.dimension);
+            J.attribute("functions", m.shape.functions);
+            J.attribute("blocks", m.shape.blocks);
+            J.attribute("fanIn", m.shape.fanIn);
+            J.attribute("intDensity", m.shape.intDensity);
+            J.attribute("seconds", m.seconds);
+            if (Cache) {
+              J.attribute("cachedSeconds", m.cachedSeconds);
+            }
+            J.attribute("peakRSSKB", static_cast<int64_t>(m.peakRSSKB));
+            J.attribute("instructionsBefore",
+                        static_cast<int64_t>(m.instructionsBefore));
+            J.attribute("instructionsAfter",
+                        static_cast<int64_t>(m.instructionsAfter));
+          });
+        }
+      });
+    });
+    out << "\n";
+  } else {
+    for (auto &m : measurements) {
+      unsigned value = m.dimension == "functions" ? m.shape.functions
+                       : m.dimension == "blocks"  ? m.shape.blocks
+                       : m.dimension == "fan-in"  ? m.shape.fanIn
+                                                  : m.shape.intDensity;
+      out << format("%-22s %-12s %6u %10.4fs %8llu KB %8llu -> %llu instrs",
+                    m.pipeline.c_str(), m.dimension.str().c_str(), value,
+                    m.seconds, (unsigned long long)m.peakRSSKB,
+                    (unsigned long long)m.instructionsBefore,
+                    (unsigned long long)m.instructionsAfter);
+      if (Cache) {
+        out << format(" %10.4fs cached", m.cachedSeconds);
+      }
+      out << "\n";
+    }
+  }
+  return 0;
+}
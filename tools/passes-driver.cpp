@@ -0,0 +1,541 @@
+#include "LLVMPasses.h"
+#include "llvm/ADT/StringSet.h"
+#include "llvm/Bitcode/BitcodeReader.h"
+#include "llvm/Bitcode/BitcodeWriter.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IR/Verifier.h"
+#include "llvm/IRReader/IRReader.h"
+#include "llvm/Linker/Linker.h"
+#include "llvm/Passes/PassBuilder.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/JSON.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/SourceMgr.h"
+#include "llvm/Support/ThreadPool.h"
+#include "llvm/Support/raw_ostream.h"
+#include <atomic>
+#include <chrono>
+
+/*
+ * Runs a pass pipeline over many bitcode or textual IR files in one process.
+ *
+ * The files are spread over a pool of workers. Every worker owns an
+ * LLVMContext and a PassBuilder with all of the passes registered, so the
+ * passes are registered once per worker instead of once per file, and no
+ * process is started per file. The pipeline itself is parsed again for every
+ * module, which is cheap next to running it, so no state a pass instance
+ * keeps carries over from one file to the next. Printer passes write to
+ * stderr from every worker, so their output is only readable with -j 1.
+ *
+ * With -function-threads, a function pipeline also runs the functions of
+ * every module on several threads. See runFunctionParallel().
+ */
+
+using namespace llvm;
+
+static cl::list<std::string> InputFilenames(cl::Positional, cl::OneOrMore,
+                                            cl::desc("<input .bc/.ll files>"));
+static cl::opt<std::string> Pipeline("passes", cl::Required,
+                                     cl::desc("Pass pipeline to run"),
+                                     cl::value_desc("pipeline"));
+static cl::opt<std::string>
+    OutputDirectory("output-dir",
+                    cl::desc("Directory the transformed modules are written "
+                             "to (default: not written)"),
+                    cl::value_desc("directory"));
+static cl::opt<bool> OutputAssembly("S",
+                                    cl::desc("Write textual IR instead of "
+                                             "bitcode"),
+                                    cl::init(false));
+static cl::opt<unsigned>
+    Threads("j", cl::desc("Number of workers (0 uses every hardware thread)"),
+            cl::init(0));
+static cl::opt<unsigned> FunctionThreads(
+    "function-threads",
+    cl::desc("Number of threads the functions of every module are spread "
+             "over, for pipelines made of function passes (default: 1)"),
+    cl::init(1));
+static cl::opt<unsigned> FunctionThreadsMinInstructions(
+    "function-threads-min-instructions",
+    cl::desc("Smallest module, in instructions, whose functions are spread "
+             "over several threads. Splitting and linking smaller ones back "
+             "costs more than the threads save (default: 20000)"),
+    cl::init(20000));
+static cl::opt<std::string>
+    ReportFilename("report", cl::desc("Write a JSON report of every file"),
+                   cl::value_desc("filename"));
+
+namespace {
+
+struct FileResult {
+  std::string input;
+  std::string output;
+  double seconds = 0;
+  uint64_t instructionsBefore = 0, instructionsAfter = 0;
+  // Empty if the pipeline succeeded.
+  std::string error;
+};
+
+uint64_t countInstructions(const Module &M) {
+  uint64_t count = 0;
+  for (auto &F : M) {
+    count += F.getInstructionCount();
+  }
+  return count;
+}
+
+/**
+ * Returns the paths the modules are written to. Inputs with the same stem get
+ * their index appended so no output overwrites another.
+ */
+std::vector<std::string> getOutputFilenames() {
+  std::vector<std::string> outputs;
+  if (OutputDirectory.empty()) {
+    outputs.resize(InputFilenames.size());
+    return outputs;
+  }
+  StringSet<> used;
+  for (auto [i, input] : enumerate(InputFilenames)) {
+    std::string stem = sys::path::stem(input).str();
+    if (!used.insert(stem).second) {
+      stem += "-" + std::to_string(i);
+    }
+    SmallString<128> path(OutputDirectory);
+    sys::path::append(path, stem + (OutputAssembly ? ".ll" : ".bc"));
+    outputs.push_back(std::string(path));
+  }
+  return outputs;
+}
+
+/**
+ * A context with the analysis managers and a pass builder that has all of the
+ * passes registered. LLVMContext is not thread-safe, so every thread that runs
+ * passes owns one.
+ */
+struct PassContext {
+  LLVMContext CTX;
+  LoopAnalysisManager LAM;
+  FunctionAnalysisManager FAM;
+  CGSCCAnalysisManager CGAM;
+  ModuleAnalysisManager MAM;
+  PassBuilder PB;
+
+  /**
+   * duplicateBBBudget replaces -duplicate-bb-module-budget for the modules
+   * run in this context.
+   */
+  explicit PassContext(
+      uint64_t duplicateBBBudget = getDuplicateBBModuleBudget()) {
+    registerDuplicateBB(PB, duplicateBBBudget);
+    registerAllPasses(PB);
+    PB.registerModuleAnalyses(MAM);
+    PB.registerCGSCCAnalyses(CGAM);
+    PB.registerFunctionAnalyses(FAM);
+    PB.registerLoopAnalyses(LAM);
+    PB.crossRegisterProxies(LAM, FAM, CGAM, MAM);
+  }
+};
+
+/**
+ * Returns false if M uses something the partitions can't be linked back
+ * from: aliases and ifuncs can't be turned into declarations, and every
+ * partition would bring its own copy of the debug info compile units.
+ */
+bool canRunFunctionParallel(const Module &M) {
+  unsigned numDefined = 0;
+  for (auto &F : M) {
+    numDefined += !F.isDeclaration();
+  }
+  return numDefined > 1 && M.alias_empty() && M.ifunc_empty() &&
+         M.debug_compile_units().empty();
+}
+
+/**
+ * Runs the function pipeline on one partition of a module, in its own
+ * context. The partition is loaded lazily from the bitcode of the whole
+ * module, so only the bodies of the functions it owns are parsed.
+ */
+class PartitionWorker : PassContext {
+  FunctionPassManager FPM;
+
+public:
+  explicit PartitionWorker(uint64_t duplicateBBBudget)
+      : PassContext(duplicateBBBudget) {}
+
+  Error init() { return PB.parsePassPipeline(FPM, Pipeline); }
+
+  /**
+   * Returns the bitcode of the partition. Functions it doesn't own become
+   * declarations. Only the first partition keeps the definitions of the
+   * global variables and the named metadata, which would otherwise be linked
+   * once per partition.
+   */
+  Expected<SmallVector<char, 0>> run(MemoryBufferRef bitcode,
+                                     StringRef identifier,
+                                     const StringSet<> &owned,
+                                     bool isFirst) {
+    auto MOrErr = getLazyBitcodeModule(bitcode, CTX);
+    if (!MOrErr) {
+      return MOrErr.takeError();
+    }
+    auto M = std::move(*MOrErr);
+    // Module::createRNG() seeds with the identifier, keep the one of the
+    // whole module so the passes behave the same as without partitions.
+    M->setModuleIdentifier(identifier);
+    for (auto &F : *M) {
+      if (F.isDeclaration()) {
+        continue;
+      }
+      if (owned.contains(F.getName())) {
+        if (auto err = F.materialize()) {
+          return std::move(err);
+        }
+      } else {
+        F.deleteBody();
+        F.setComdat(nullptr);
+      }
+    }
+    if (!isFirst) {
+      for (auto &GV : make_early_inc_range(M->globals())) {
+        if (GV.hasAppendingLinkage()) {
+          GV.eraseFromParent();
+        } else if (!GV.isDeclaration()) {
+          GV.setInitializer(nullptr);
+          GV.setLinkage(GlobalValue::ExternalLinkage);
+          GV.setComdat(nullptr);
+        }
+      }
+      for (auto &NMD : make_early_inc_range(M->named_metadata())) {
+        if (NMD.getName() != "llvm.module.flags") {
+          M->eraseNamedMetadata(&NMD);
+        }
+      }
+    }
+    if (auto err = M->materializeAll()) {
+      return std::move(err);
+    }
+
+    for (auto &F : *M) {
+      if (!F.isDeclaration()) {
+        FPM.run(F, FAM);
+      }
+    }
+    // The results refer to this module, which is destroyed below.
+    FAM.clear();
+
+    SmallVector<char, 0> buffer;
+    raw_svector_ostream out(buffer);
+    WriteBitcodeToFile(*M, out);
+    return buffer;
+  }
+};
+
+struct Partition {
+  StringSet<> functions;
+  uint64_t numInstructions = 0;
+};
+
+/**
+ * Splits the defined functions into partitions of about the same number of
+ * instructions. Functions in a comdat stay in the first partition, which
+ * keeps the rest of the comdat.
+ */
+std::vector<Partition> partitionFunctions(const Module &M,
+                                          unsigned numPartitions) {
+  std::vector<const Function *> functions;
+  for (auto &F : M) {
+    if (!F.isDeclaration()) {
+      functions.push_back(&F);
+    }
+  }
+  llvm::stable_sort(functions, [](const Function *a, const Function *b) {
+    return a->getInstructionCount() > b->getInstructionCount();
+  });
+
+  std::vector<Partition> partitions(numPartitions);
+  for (auto F : functions) {
+    auto smallest =
+        F->hasComdat()
+            ? partitions.begin()
+            : std::min_element(partitions.begin(), partitions.end(),
+                               [](const Partition &a, const Partition &b) {
+                                 return a.numInstructions < b.numInstructions;
+                               });
+    smallest->functions.insert(F->getName());
+    smallest->numInstructions += F->getInstructionCount();
+  }
+  return partitions;
+}
+
+/**
+ * Runs the function pipeline on the functions of M in parallel and returns
+ * the resulting module, in the context of M.
+ *
+ * Constants, types and globals are uniqued in the LLVMContext, which is not
+ * thread-safe, so the threads can't share M. Instead M is written to bitcode
+ * once and every thread loads the functions it owns into a context of its
+ * own, with its own analysis managers and instances of the passes. Every
+ * partition gets the share of -duplicate-bb-module-budget of its size, so
+ * together they add no more than the whole module would. The partitions are
+ * then linked back into a single module. Local symbols are
+ * made external while the module is split, so a function and its callers may
+ * end up in different partitions, and get their linkage back afterwards.
+ */
+Expected<std::unique_ptr<Module>> runFunctionParallel(Module &M) {
+  StringMap<std::pair<GlobalValue::LinkageTypes, bool>> locals;
+  for (auto &GV : M.global_values()) {
+    if (!GV.hasLocalLinkage()) {
+      continue;
+    }
+    bool unnamed = !GV.hasName();
+    if (unnamed) {
+      GV.setName("__passes_driver_unnamed");
+    }
+    locals[GV.getName()] = {GV.getLinkage(), unnamed};
+    GV.setLinkage(GlobalValue::ExternalLinkage);
+  }
+
+  SmallVector<char, 0> bitcode;
+  raw_svector_ostream bitcodeStream(bitcode);
+  WriteBitcodeToFile(M, bitcodeStream);
+  MemoryBufferRef bitcodeRef(StringRef(bitcode.data(), bitcode.size()),
+                             M.getModuleIdentifier());
+
+  auto partitions = partitionFunctions(M, FunctionThreads);
+  uint64_t numInstructions = 0;
+  for (auto &partition : partitions) {
+    numInstructions += partition.numInstructions;
+  }
+  uint64_t budget = getDuplicateBBModuleBudget();
+
+  std::vector<SmallVector<char, 0>> outputs(partitions.size());
+  std::vector<std::string> errors(partitions.size());
+  DefaultThreadPool pool(hardware_concurrency(FunctionThreads));
+  for (size_t i = 0; i < partitions.size(); ++i) {
+    pool.async([&, i] {
+      PartitionWorker worker(
+          budget == UINT64_MAX
+              ? budget
+              : budget * partitions[i].numInstructions / numInstructions);
+      cantFail(worker.init());
+      auto output = worker.run(bitcodeRef, M.getModuleIdentifier(),
+                               partitions[i].functions, i == 0);
+      if (output) {
+        outputs[i] = std::move(*output);
+      } else {
+        errors[i] = toString(output.takeError());
+      }
+    });
+  }
+  pool.wait();
+
+  std::unique_ptr<Module> linked;
+  for (size_t i = 0; i < outputs.size(); ++i) {
+    if (!errors[i].empty()) {
+      return createStringError(inconvertibleErrorCode(), errors[i].c_str());
+    }
+    MemoryBufferRef ref(StringRef(outputs[i].data(), outputs[i].size()),
+                        M.getModuleIdentifier());
+    auto partition = parseBitcodeFile(ref, M.getContext());
+    if (!partition) {
+      return partition.takeError();
+    }
+    if (!linked) {
+      linked = std::move(*partition);
+    } else if (Linker::linkModules(*linked, std::move(*partition))) {
+      return createStringError(inconvertibleErrorCode(),
+                               "could not link partition %zu", i);
+    }
+  }
+
+  for (auto &local : locals) {
+    auto GV = linked->getNamedValue(local.getKey());
+    GV->setLinkage(local.getValue().first);
+    if (local.getValue().second) {
+      GV->setName("");
+    }
+  }
+  linked->setModuleIdentifier(M.getModuleIdentifier());
+  return std::move(linked);
+}
+
+/**
+ * State owned by a single worker. LLVMContext is not thread-safe, so every
+ * worker parses its files into its own context.
+ */
+class Worker : PassContext {
+public:
+  /**
+   * Parses the pipeline into MPM. Every module gets a new pass manager, so
+   * e.g. the growth DuplicateBB counts against -duplicate-bb-module-budget
+   * doesn't depend on the files the worker ran before.
+   */
+  Error buildPipeline(ModulePassManager &MPM) {
+    if (FunctionThreads <= 1) {
+      return PB.parsePassPipeline(MPM, Pipeline);
+    }
+    FunctionPassManager FPM;
+    if (auto err = PB.parsePassPipeline(FPM, Pipeline)) {
+      return joinErrors(
+          createStringError(inconvertibleErrorCode(),
+                            "-function-threads needs a pipeline of function "
+                            "passes"),
+          std::move(err));
+    }
+    // Runs modules that can't be split.
+    MPM.addPass(createModuleToFunctionPassAdaptor(std::move(FPM)));
+    return Error::success();
+  }
+
+  void run(FileResult &result) {
+    auto start = std::chrono::steady_clock::now();
+    runPipeline(result);
+    result.seconds = std::chrono::duration<double>(
+                         std::chrono::steady_clock::now() - start)
+                         .count();
+  }
+
+private:
+  void runPipeline(FileResult &result) {
+    SMDiagnostic diagnostic;
+    auto M = parseIRFile(result.input, diagnostic, CTX);
+    if (!M) {
+      raw_string_ostream os(result.error);
+      diagnostic.print("passes-driver", os, /*ShowColors=*/false);
+      return;
+    }
+
+    result.instructionsBefore = countInstructions(*M);
+    if (FunctionThreads > 1 &&
+        result.instructionsBefore >= FunctionThreadsMinInstructions &&
+        canRunFunctionParallel(*M)) {
+      auto linked = runFunctionParallel(*M);
+      if (!linked) {
+        result.error = toString(linked.takeError());
+        return;
+      }
+      M = std::move(*linked);
+    } else {
+      ModulePassManager MPM;
+      cantFail(buildPipeline(MPM));
+      MPM.run(*M, MAM);
+      // The results refer to this module, which is destroyed below.
+      MAM.clear();
+    }
+    result.instructionsAfter = countInstructions(*M);
+    {
+      raw_string_ostream os(result.error);
+      if (verifyModule(*M, &os)) {
+        return;
+      }
+    }
+
+    if (!result.output.empty()) {
+      std::error_code EC;
+      raw_fd_ostream out(result.output, EC,
+                         OutputAssembly ? sys::fs::OF_Text : sys::fs::OF_None);
+      if (EC) {
+        result.error = "could not open " + result.output + ": " + EC.message();
+        return;
+      }
+      if (OutputAssembly) {
+        M->print(out, nullptr);
+      } else {
+        WriteBitcodeToFile(*M, out);
+      }
+    }
+  }
+};
+
+} // namespace
+
+int main(int argc, char **argv) {
+  cl::ParseCommandLineOptions(argc, argv, "Batch pass pipeline driver\n");
+
+  // Report a bad pipeline once instead of from every worker.
+  ModulePassManager MPM;
+  if (auto err = Worker().buildPipeline(MPM)) {
+    errs() << "Invalid pipeline: " << toString(std::move(err)) << "\n";
+    return 1;
+  }
+  if (!OutputDirectory.empty()) {
+    if (auto EC = sys::fs::create_directories(OutputDirectory)) {
+      errs() << "Could not create " << OutputDirectory << ": " << EC.message()
+             << "\n";
+      return 1;
+    }
+  }
+
+  std::vector<FileResult> results(InputFilenames.size());
+  auto outputs = getOutputFilenames();
+  for (auto [i, result] : enumerate(results)) {
+    result.input = InputFilenames[i];
+    result.output = outputs[i];
+  }
+
+  // Workers pull the next file from a shared index, so slow files don't hold
+  // up a statically assigned share of the others.
+  auto start = std::chrono::steady_clock::now();
+  DefaultThreadPool pool(hardware_concurrency(Threads));
+  unsigned numWorkers = std::min<size_t>(
+      std::max(pool.getMaxConcurrency(), 1U), results.size());
+  std::atomic<size_t> next{0};
+  for (unsigned i = 0; i < numWorkers; ++i) {
+    pool.async([&] {
+      Worker worker;
+      for (size_t file; (file = next++) < results.size();) {
+        worker.run(results[file]);
+      }
+    });
+  }
+  pool.wait();
+  double seconds =
+      std::chrono::duration<double>(std::chrono::steady_clock::now() - start)
+          .count();
+
+  unsigned numFailed = 0;
+  for (auto &result : results) {
+    if (!result.error.empty()) {
+      errs() << result.input << ": " << result.error << "\n";
+      ++numFailed;
+    }
+  }
+
+  if (!ReportFilename.empty()) {
+    std::error_code EC;
+    raw_fd_ostream out(ReportFilename, EC, sys::fs::OF_Text);
+    if (EC) {
+      errs() << "Could not open " << ReportFilename << ": " << EC.message()
+             << "\n";
+      return 1;
+    }
+    json::OStream J(out, 2);
+    J.object([&] {
+      J.attribute("pipeline", Pipeline);
+      J.attribute("workers", numWorkers);
+      J.attribute("seconds", seconds);
+      J.attributeArray("files", [&] {
+        for (auto &result : results) {
+          J.object([&] {
+            J.attribute("input", result.input);
+            if (!result.output.empty()) {
+              J.attribute("output", result.output);
+            }
+            J.attribute("seconds", result.seconds);
+            J.attribute("instructionsBefore",
+                        static_cast<int64_t>(result.instructionsBefore));
+            J.attribute("instructionsAfter",
+                        static_cast<int64_t>(result.instructionsAfter));
+            if (!result.error.empty()) {
+              J.attribute("error", result.error);
+            }
+          });
+        }
+      });
+    });
+    out << "\n";
+  }
+  return numFailed ? 1 : 0;
+}